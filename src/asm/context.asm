@@ -56,7 +56,11 @@ bits 64
         pop r15
         mov cr0, r15
         pop r15
+        ;; Zero if the page tables are already loaded
+        test r15, r15
+        jz %%loaded
         mov cr3, r15
+%%loaded:
         pop r15
         mov cr4, r15
         pop rax
@@ -42,6 +42,8 @@ _install_idt:
 %macro common_idt_stub 1
 section .userspace
 extern Arc_KernelPageTables
+extern tlb_enter
+extern tlb_leave
 global _idt_stub_%1
 extern generic_interrupt_handler_%1
 _idt_stub_%1:
@@ -53,8 +55,6 @@ _idt_stub_%1:
 %endif
         PUSH_ALL
 
-        mov rdi, rsp
-
         mov ax, cs
         cmp ax, [rsp + 160]
         je .over
@@ -65,11 +65,22 @@ _idt_stub_%1:
         mov ss, ax
 
         lea rax, [rel Arc_KernelPageTables]
-        mov rax, [rax]
+        mov rdi, [rax]
+        call tlb_enter
+        test rax, rax
+        jz .stay
         mov cr3, rax
+        .stay:
 
+        mov rdi, rsp
         call generic_interrupt_handler_%1
 
+        ;; Let the CR3 being returned to keep its TLB entries if they
+        ;; are still up to date
+        mov rdi, [rsp + 8]
+        call tlb_leave
+        mov [rsp + 8], rax
+
         mov ax, cs
         cmp ax, [rsp + 160]
         je .over1
@@ -36,6 +36,8 @@ global _syscall
 extern Arc_SyscallTable
 extern Arc_KernelPageTables
 extern syscall_get_kpages
+extern tlb_enter
+extern tlb_leave
 extern syscall_get_stack
 extern syscall_free_stack 
 _syscall:
@@ -48,6 +50,16 @@ _syscall:
         call syscall_get_stack  ; Get the stack
         mov rsp, rax            ; Switch to kernel stack
         
+        ;; Preserve the arguments across the C calls
+        push rdi
+        push rsi
+        push rdx
+        push rcx
+        push r8
+        push r9
+        push r10
+        push r11
+
         ;; TODO: Would be nice to get rid of this call
         ;;       such that it could just be:
         ;;       mov rax, [gs:<offset of descriptor pointer>]
@@ -56,7 +68,20 @@ _syscall:
         ;;       Problem: don't know those offsets, and don't
         ;;       know how to get them
         call syscall_get_kpages
+        mov rdi, rax
+        call tlb_enter
+        pop r11
+        pop r10
+        pop r9
+        pop r8
+        pop rcx
+        pop rdx
+        pop rsi
+        pop rdi
+        test rax, rax
+        jz .stay
         mov cr3, rax
+        .stay:
 
         ;; "pop rax"
         mov rax, qword [rdx]
@@ -78,6 +103,10 @@ _syscall:
         call [rax]
         mov qword [rsp + 24], rax
 
+        mov rdi, [rsp + 8]
+        call tlb_leave
+        mov [rsp + 8], rax
+
         POP_ALL                 ;Restore user context
         add rsp, 8
         pop rcx
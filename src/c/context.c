@@ -25,10 +25,15 @@
  * @DESCRIPTION
 */
 #include "arch/context.h"
+#include "arch/info.h"
 #include "arch/smp.h"
 #include "arch/x86-64/context.h"
 #include "arch/x86-64/ctrl_regs.h"
+#include "arch/x86-64/pager.h"
+#include "arch/x86-64/pkey.h"
 #include "arch/x86-64/smp.h"
+#include "arch/x86-64/tlb.h"
+#include "arch/x86-64/util.h"
 #include "arctan.h"
 #include "global.h"
 #include "mm/allocator.h"
@@ -73,6 +78,15 @@ void context_save(ARC_Context *ctx, ARC_InterruptFrame *new) {
                          mov rdx, rax;                                  \
                          fxsave [%0];" :: "r"(ctx->xsave_space) : "rax", "rdx");
         }
+
+        // Protection key rights belong to the thread
+        if (MASKED_READ(ctx->frame.gpr.cr4, 22, 1)) {
+                ctx->pkru = pkey_read_pkru();
+        }
+
+        if (MASKED_READ(ctx->frame.gpr.cr4, 24, 1)) {
+                ctx->pkrs = pkey_read_pkrs();
+        }
 }
 
 void context_load(ARC_Context *ctx, ARC_InterruptFrame *to) {
@@ -91,6 +105,41 @@ void context_load(ARC_Context *ctx, ARC_InterruptFrame *to) {
                          fxrstor [%0];" :: "r"(ctx->xsave_space) : "rax", "rdx");
         }
 
+        if (MASKED_READ(ctx->frame.gpr.cr4, 22, 1)) {
+                pkey_write_pkru(ctx->pkru);
+        }
+
+        if (MASKED_READ(ctx->frame.gpr.cr4, 24, 1)) {
+                pkey_write_pkrs(ctx->pkrs);
+        }
+}
+
+/**
+ * Load the pager's PAT layout (ARC_PAGER_PAT_LAYOUT).
+ *
+ * Follows the sequence the SDM gives for changing memory types: with caches
+ * disabled, written back and the TLB flushed, so that no line or entry of
+ * the old types is left around.
+ * */
+static void context_set_pat() {
+        bool I = arch_interrupts_enabled();
+        ARC_DISABLE_INTERRUPT;
+
+        uint64_t cr0 = _x86_getCR0();
+        // CD set, NW clear
+        _x86_setCR0((cr0 | (1ULL << 30)) & ~(1ULL << 29));
+        __asm__("wbinvd" ::: "memory");
+        tlb_flush_global();
+
+        _x86_WRMSR(0x277, ARC_PAGER_PAT_LAYOUT);
+
+        __asm__("wbinvd" ::: "memory");
+        tlb_flush_global();
+        _x86_setCR0(cr0);
+
+        if (I) {
+                ARC_ENABLE_INTERRUPT;
+        }
 }
 
 int context_set_proc_features(ARC_ProcessorFeatures *features) {
@@ -125,6 +174,17 @@ int context_set_proc_features(ARC_ProcessorFeatures *features) {
                 ARC_DEBUG(INFO, "PCIDs supported\n");
         }
 
+        if (MASKED_READ(edx, 13, 1)) {
+                // Only pages the pager maps global are kept across address
+                // space switches
+                uint64_t cr4 = _x86_getCR4() | (1 << 7); // PGE
+                _x86_setCR4(cr4);
+        }
+
+        if (MASKED_READ(edx, 16, 1)) {
+                context_set_pat();
+        }
+
         features->proc0 |= MASKED_READ(ecx, 25, 1) << ARC_PROC0_FLAG_SSE1;
         features->proc0 |= MASKED_READ(ecx, 26, 1) << ARC_PROC0_FLAG_SSE2;
         features->proc0 |= MASKED_READ(edx, 1,  1) << ARC_PROC0_FLAG_SSE3;
@@ -156,6 +216,19 @@ int context_set_proc_features(ARC_ProcessorFeatures *features) {
                 features->paging |= 1 << ARC_PAGER_FLAG_PKS;
         }
 
+        init_pkey();
+
+        __cpuid(0x80000000, eax, ebx, ecx, edx);
+
+        if (eax >= 0x80000001) {
+                __cpuid(0x80000001, eax, ebx, ecx, edx);
+
+                if (MASKED_READ(edx, 26, 1)) {
+                        ARC_DEBUG(INFO, "1GiB pages supported\n");
+                        features->paging |= 1 << ARC_PAGER_FLAG_GIB;
+                }
+        }
+
         return 0;
 }
 
@@ -240,6 +313,8 @@ ARC_Context *init_context(uint64_t flags, ARC_ProcessorFeatures *features) {
 
         ret->frame.gpr.cr0 = _x86_getCR0();
         ret->frame.gpr.cr4 = _x86_getCR4();
+        ret->pkru = ARC_PKEY_DEFAULT_RIGHTS;
+        ret->pkrs = ARC_PKEY_DEFAULT_RIGHTS;
 
         if (MASKED_READ(flags, ARC_CONTEXT_FLAG_FLOATS, 1)) {
                 features->proc0 |= 1 << ARC_PROC0_FLAG_SSE1;
@@ -31,6 +31,7 @@
 #include "arch/pager.h"
 #include "arch/x86-64/apic/local.h"
 #include "arch/x86-64/context.h"
+#include "arch/x86-64/pager.h"
 #include "arch/x86-64/smp.h"
 #include "arch/x86-64/util.h"
 #include "config.h"
@@ -229,7 +230,22 @@ GENERIC_HANDLER(14) {
         uintptr_t kernel = process == NULL ? 0 : (uintptr_t)process->page_tables.kernel;
         uintptr_t user   = process == NULL ? 0 : (uintptr_t)process->page_tables.user;
 
-        if (frame->cs == 0x8 && frame->gpr.cr3 == ARC_HHDM_TO_PHYS(kernel)) {
+        // Write to a present page, not caused by a reserved bit or a
+        // protection key
+        bool write = (frame->error & 0b101011) == 0b11;
+
+        if (write && user != 0 && vaddr <= ARC_HHDM_VADDR
+            && pager_resolve_cow((void *)user, vaddr) == 0) {
+                // Write to a copy-on-write page of the process, which now
+                // has a copy of its own. Drop the kernel's copy of the old
+                // entry, it is cloned again on the next access.
+                if (kernel != 0 && pager_unmap((void *)kernel, ALIGN_DOWN(vaddr, PAGE_SIZE), PAGE_SIZE, NULL) != 0) {
+                        goto panic;
+                }
+        } else if (write && vaddr > ARC_HHDM_VADDR
+                   && pager_resolve_cow((void *)ARC_PHYS_TO_HHDM(frame->gpr.cr3), vaddr) == 0) {
+                // First write to a lazily mapped kernel page
+        } else if (frame->cs == 0x8 && frame->gpr.cr3 == ARC_HHDM_TO_PHYS(kernel)) {
                 int r = 0;
 
                 if (vaddr >= ARC_HHDM_VADDR && vaddr <= (uintptr_t)&__KERNEL_START__) {
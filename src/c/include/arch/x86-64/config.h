@@ -37,6 +37,93 @@
         #define ARC_SYSCALL_STACK_SIZE 0x2000
 #endif
 
+#ifndef ARC_TLB_FLUSH_THRESHOLD
+        // The number of pages a single operation may invalidate one by one
+        // before the whole address space is flushed instead.
+        #define ARC_TLB_FLUSH_THRESHOLD 32
+#endif
+
+#ifndef ARC_PAGER_COLLAPSE_START
+        // The first address of the kernel's address space scanned for page
+        // tables to collapse while idle.
+        #define ARC_PAGER_COLLAPSE_START 0xFFFF800000000000
+#endif
+
+#ifndef ARC_PAGER_SHARE_BUCKETS
+        // The number of buckets in the table counting the mappings of
+        // pages shared copy-on-write. Must be a power of two.
+        #define ARC_PAGER_SHARE_BUCKETS 1024
+#endif
+
+#ifndef ARC_PAGER_SLOT_LOCKS
+        // The number of locks guarding the tables below the entries of a
+        // PML4 from being freed while walked. Must be a power of two.
+        #define ARC_PAGER_SLOT_LOCKS 256
+#endif
+
+#ifndef ARC_PAGER_XLAT_SIZE
+        // The number of translations each processor keeps for pager_query.
+        // Must be a power of two.
+        #define ARC_PAGER_XLAT_SIZE 64
+#endif
+
+#ifndef ARC_PAGER_ZERO_CACHE_SIZE
+        // The number of zeroed pages each processor keeps at hand for
+        // new page tables and mappings.
+        #define ARC_PAGER_ZERO_CACHE_SIZE 32
+#endif
+
+#ifndef ARC_PAGER_ZERO_POOL_SIZE
+        // The number of zeroed pages idle processors keep at hand for all
+        // processors.
+        #define ARC_PAGER_ZERO_POOL_SIZE 256
+#endif
+
+#ifndef ARC_SMP_IDLE_TIMER_COUNT
+        // The initial count of the LAPIC timer that wakes idle APs to do
+        // their idle work (see smp_hold).
+        #define ARC_SMP_IDLE_TIMER_COUNT 0x100000
+#endif
+
+#ifndef ARC_PAGER_SHARE_KERNEL_HALF
+        // Whether new page tables share the kernel's half of the address
+        // space from creation on, rather than having it mapped in as needed.
+        // 0 - Never
+        // 1 - If the processor is not affected by Meltdown (RDCL_NO)
+        // 2 - Always
+        #define ARC_PAGER_SHARE_KERNEL_HALF 1
+#endif
+
+#ifndef ARC_PAGER_SHARED_ENTRY
+        // Whether interrupts and syscalls stay on the page tables of
+        // userspace when those share the kernel's half, rather than loading
+        // the kernel's page tables. Only takes effect if the kernel's half
+        // is shared (see ARC_PAGER_SHARE_KERNEL_HALF).
+        #define ARC_PAGER_SHARED_ENTRY 0
+#endif
+
+#ifndef ARC_NUMA_MAX_NODES
+        // The most NUMA nodes told apart, memory and processors of any
+        // further nodes are treated as being on no node
+        #define ARC_NUMA_MAX_NODES 8
+#endif
+
+#ifndef ARC_NUMA_MAX_RANGES
+        // The most memory ranges taken from the SRAT
+        #define ARC_NUMA_MAX_RANGES 32
+#endif
+
+#ifndef ARC_NUMA_POOL_SIZE
+        // Pages kept for each node that were allocated for another
+        #define ARC_NUMA_POOL_SIZE 64
+#endif
+
+#ifndef ARC_NUMA_ALLOC_TRIES
+        // Allocations made in search of memory on the wanted node, before
+        // settling for memory on any node
+        #define ARC_NUMA_ALLOC_TRIES 8
+#endif
+
 #ifndef ARC_PMM_LOW_MEM_LIM
         // The first address from zero that is in high memory.
         // Where a is an address:
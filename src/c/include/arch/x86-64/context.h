@@ -56,7 +56,10 @@
         asm("pop r15;\
         mov cr0, r15; \
         pop r15; \
+        test r15, r15; \
+        jz 2f; \
         mov cr3, r15;\
+        2: \
         pop r15; \
         mov cr4, r15; \
         pop rax; \
@@ -109,6 +112,8 @@ typedef struct ARC_InterruptFrame {
 typedef struct ARC_Context {
 	void *xsave_space;
 	void *tcb;
+	uint32_t pkru; // User protection key rights
+	uint32_t pkrs; // Supervisor protection key rights
 	ARC_InterruptFrame frame;
 } ARC_Context;
 
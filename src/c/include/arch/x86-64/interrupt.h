@@ -29,6 +29,10 @@
 
 #include <stdint.h>
 
+// Defined in tlb.c, see arch/x86-64/tlb.h
+uint64_t tlb_enter(uint64_t cr3);
+uint64_t tlb_leave(uint64_t cr3);
+
 // TODO: Using printf in an interrupt (that doesn't panic the kernel) will cause
 //       a deadlock if anything else is printing. So, code that is called from an
 //       interrupt handler should not use printfs. The best way to resolve this is to
@@ -53,15 +57,22 @@
                          je 1f; \
                          swapgs; \
                          1:"); \
-                __asm__("mov rax, [rax]; \
+                __asm__("mov rdi, [rax]; \
+                         call %2; \
+                         test rax, rax; \
+                         jz 1f; \
                          mov cr3, rax; \
+                         1: \
                          mov rdi, rsp; \
                          call %1; \
+                         mov rdi, [rsp + 8]; \
+                         call %3; \
+                         mov [rsp + 8], rax; \
                          mov ax, cs; \
                          cmp ax, [rsp + 160]; \
                          je 1f; \
                          swapgs; \
-                         1:" :: "a"(&_page_tables), "i"(_handler) :); \
+                         1:" :: "a"(&_page_tables), "i"(_handler), "i"(tlb_enter), "i"(tlb_leave) :); \
                 ARC_ASM_POP_ALL \
                 __asm__("add rsp, 8;\
                          iretq"); \
@@ -0,0 +1,138 @@
+/**
+ * @file numa.h
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Karch-x86-64 - x86-64 Implementation of K/arch Abstractions
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Karch-x86-64.
+ *
+ * Arctan-OS/Karch-x86-64 is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Non-uniform memory access: which node processors and memory are on,
+ * and allocation of memory on a given node.
+*/
+#ifndef ARC_ARCH_X86_64_NUMA_H
+#define ARC_ARCH_X86_64_NUMA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Node of memory and processors the SRAT says nothing about
+#define ARC_NUMA_NO_NODE ((uint32_t)-1)
+
+/**
+ * Take the nodes of processors and memory from the SRAT.
+ *
+ * Proximity domains are numbered from zero as nodes in the order they
+ * first appear. Must be called by the kernel's ACPI code before
+ * init_arch starts the APs, so that their structures can be allocated on
+ * their own node.
+ *
+ * @param const void *srat - The SRAT, including its header.
+ * @return zero on success.
+ * */
+int numa_parse_srat(const void *srat);
+
+/**
+ * Take the distances between nodes from the SLIT.
+ *
+ * NOTE: Must be called after numa_parse_srat, as the SLIT is indexed by
+ *       proximity domain.
+ *
+ * @param const void *slit - The SLIT, including its header.
+ * @return zero on success.
+ * */
+int numa_parse_slit(const void *slit);
+
+/**
+ * @return the number of nodes, zero if no SRAT was parsed.
+ * */
+uint32_t numa_node_count();
+
+/**
+ * Get the node of a processor.
+ *
+ * @param uint32_t apic - The (x2)APIC ID of the processor.
+ * @return the node, ARC_NUMA_NO_NODE if it is not known.
+ * */
+uint32_t numa_node_of_processor(uint32_t apic);
+
+/**
+ * Get the node of the processor this runs on.
+ *
+ * Works before the processor has a descriptor, afterwards its numa_node
+ * is cheaper.
+ *
+ * @return the node, ARC_NUMA_NO_NODE if it is not known.
+ * */
+uint32_t numa_current_node();
+
+/**
+ * Get the node of physical memory.
+ *
+ * @param uintptr_t physical - The physical address.
+ * @param size_t size - The size of the memory, all of which must be on the node.
+ * @return the node, ARC_NUMA_NO_NODE if it is not known or the memory spans nodes.
+ * */
+uint32_t numa_node_of_memory(uintptr_t physical, size_t size);
+
+/**
+ * Get the relative distance between two nodes.
+ *
+ * @param uint32_t from - The node accessing memory.
+ * @param uint32_t to - The node the memory is on.
+ * @return the distance, 10 being the distance of a node to itself.
+ * */
+uint8_t numa_distance(uint32_t from, uint32_t to);
+
+/**
+ * Allocate a page on a node.
+ *
+ * Pages allocated on the way that are on other nodes are kept for those,
+ * at most ARC_NUMA_ALLOC_TRIES are allocated in all. If no page on the node
+ * turns up, a page on any node is returned, taken from the pages kept for
+ * other nodes if the PMM is out of memory. The page is an ordinary page and
+ * is freed with pmm_fast_page_free.
+ *
+ * @param uint32_t node - The node to allocate on.
+ * @return the HHDM address of the page, NULL on failure.
+ * */
+void *numa_page_alloc(uint32_t node);
+
+/**
+ * Give the pages kept for each node back to the PMM.
+ *
+ * For when memory runs low, the pools are refilled as pages are allocated.
+ *
+ * @return the number of pages given back.
+ * */
+size_t numa_drain_pools();
+
+/**
+ * Allocate physically contiguous memory on a node.
+ *
+ * If no memory on the node turns up, memory on any node is returned. The
+ * memory is freed with pmm_free.
+ *
+ * @param size_t size - The size of the memory in bytes.
+ * @param uint32_t node - The node to allocate on.
+ * @return the HHDM address of the memory, NULL on failure.
+ * */
+void *numa_alloc(size_t size, uint32_t node);
+
+#endif
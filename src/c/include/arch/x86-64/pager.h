@@ -0,0 +1,305 @@
+/**
+ * @file pager.h
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Karch-x86-64 - x86-64 Implementation of K/arch Abstractions
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Karch-x86-64.
+ *
+ * Arctan-OS/Karch-x86-64 is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * x86-64 specific extensions to the pager.
+*/
+#ifndef ARC_ARCH_X86_64_PAGER_H
+#define ARC_ARCH_X86_64_PAGER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Protection key of the pages (see arch/x86-64/pkey.h), a 4 bit field in
+// the attributes of pager_map, pager_fly_map and pager_set_attr
+#define ARC_PAGER_PKEY 16
+#define ARC_PAGER_PKEY_OF(key) ((uint32_t)((key) & 0xF) << ARC_PAGER_PKEY)
+// Keep the pages cached across address space switches. Mappings in the
+// kernel's half of page tables that share it get this on their own, it is
+// ignored unless the kernel's half is shared (see pager_shares_kernel_half).
+#define ARC_PAGER_GLOBAL 20
+
+// Memory types for the ARC_PAGER_PAT field, each is the index of its entry
+// in the PAT. The first four match the PAT's power-on layout.
+#define ARC_PAGER_MEM_WB (0 << ARC_PAGER_PAT) // Write back
+#define ARC_PAGER_MEM_WT (1 << ARC_PAGER_PAT) // Write through
+#define ARC_PAGER_MEM_UC_MINUS (2 << ARC_PAGER_PAT) // Uncached, unless the MTRRs say write combining
+#define ARC_PAGER_MEM_UC (3 << ARC_PAGER_PAT) // Uncached
+#define ARC_PAGER_MEM_WC (4 << ARC_PAGER_PAT) // Write combining
+#define ARC_PAGER_MEM_WP (5 << ARC_PAGER_PAT) // Write protected
+// The PAT programmed on every processor, one byte per entry: WB, WT, UC-,
+// UC, WC, WP, UC-, UC
+#define ARC_PAGER_PAT_LAYOUT 0x0007050100070406ULL
+
+// Paging events, counted by each processor (see pager_counters)
+typedef struct ARC_PagerCounters {
+        uint64_t invlpg; // Pages invalidated one by one
+        uint64_t flushes; // Whole TLB flushes
+        uint64_t cr3_loads; // Address space switches
+        uint64_t shootdowns; // Shootdown IPIs sent
+        uint64_t tables_allocated; // Page table pages put into page tables
+        uint64_t tables_freed; // Page table pages taken out of page tables
+        uint64_t splits; // Huge pages split into tables
+        uint64_t collapses; // Tables collapsed into huge pages
+        uint64_t unshares; // Shared tables copied before a change
+        uint64_t cow_faults; // Copy on write pages resolved
+} ARC_PagerCounters;
+
+// A snapshot of the page tables of an address space (see pager_stats)
+typedef struct ARC_PagerStats {
+        size_t tables[4]; // Table pages, tables[n] are those of level n + 1
+        size_t entries; // Present entries in those tables
+        size_t shared_tables; // Tables also in other page tables
+        size_t sparse_tables; // Tables with fewer than an eighth of their entries present
+        size_t pages[3]; // Pages mapped, by size: 4 KiB, 2 MiB and 1 GiB
+        size_t mergeable; // Page tables pager_collapse could turn into 2 MiB pages
+        size_t mapped; // Bytes mapped
+} ARC_PagerStats;
+
+// A physically contiguous part of the memory mapped by pager_map_sg
+typedef struct ARC_PagerSegment {
+        uintptr_t physical;
+        size_t size;
+} ARC_PagerSegment;
+
+typedef struct ARC_PagerTranslation {
+        uintptr_t physical; // The address translated to, zero if not mapped
+        size_t page_size; // The size of the page holding the address
+        uint32_t attributes; // ARC_PAGER_* attributes of the page
+} ARC_PagerTranslation;
+
+/**
+ * Translate virtual addresses and look up the pages holding them.
+ *
+ * No page tables are ever created. Translations are cached by each
+ * processor, a cached translation is used until anything changes the
+ * tables below the same PML4 entry.
+ *
+ * @param void *page_tables - The page tables to look in, NULL for the current ones.
+ * @param const uintptr_t *virtual - The addresses to translate.
+ * @param ARC_PagerTranslation *translations - The translation of each address.
+ * @param size_t count - The number of addresses.
+ * @return the number of addresses that are not mapped.
+ * */
+size_t pager_query(void *page_tables, const uintptr_t *virtual, ARC_PagerTranslation *translations, size_t count);
+
+/**
+ * Translate a virtual address to a physical address.
+ *
+ * @param void *page_tables - The page tables to look in, NULL for the current ones.
+ * @param uintptr_t virtual - The address to translate.
+ * @param uintptr_t *physical - Set to the physical address.
+ * @return zero if the address is mapped.
+ * */
+int pager_translate(void *page_tables, uintptr_t virtual, uintptr_t *physical);
+
+/**
+ * Collect the accessed and dirty bits of a range.
+ *
+ * Bit n of each bitmap stands for the 4 KiB page at virtual + n * 4 KiB,
+ * pages of a huge page all get the huge page's bits. The bitmaps need room
+ * for one bit per page, rounded up to whole 64-bit words. Huge pages are
+ * left whole and no page tables are created.
+ *
+ * @param void *page_tables - The page tables to look in, NULL for the current ones.
+ * @param uintptr_t virtual - The start of the range.
+ * @param size_t size - The size of the range in bytes.
+ * @param uint64_t *accessed - Bitmap of the pages that were accessed, may be NULL.
+ * @param uint64_t *dirty - Bitmap of the pages that were written to, may be NULL.
+ * @param bool clear - Clear the bits after collecting them, flushing the pages once at the end.
+ * @return zero on success.
+ * */
+int pager_harvest(void *page_tables, uintptr_t virtual, size_t size, uint64_t *accessed, uint64_t *dirty, bool clear);
+
+/**
+ * Check whether page tables share the kernel's half of the address space.
+ *
+ * Page tables created while ARC_PAGER_SHARE_KERNEL_HALF is in effect refer
+ * to the same PML3 tables as Arc_KernelPageTables for the higher half, so
+ * anything mapped there by the kernel is already present in them.
+ *
+ * @param void *page_tables - The page tables to check.
+ * @return true if the kernel's half is shared.
+ * */
+bool pager_shares_kernel_half(void *page_tables);
+
+/**
+ * Choose whether entries into the kernel switch page tables.
+ *
+ * When enabled, interrupts and syscalls taken on page tables that share the
+ * kernel's half run the kernel on them, rather than loading the kernel's
+ * page tables and loading the interrupted ones back on return. Only the
+ * kernel's half is guaranteed to be the same as in the kernel's page
+ * tables, the rest is that of the interrupted page tables.
+ *
+ * Each process still has its own PCIDs for its user and kernel page tables
+ * either way, which are switched between without flushing.
+ *
+ * @param bool enable - Stay on the interrupted page tables.
+ * @return zero on success, non-zero if the kernel's half is not shared.
+ * */
+int pager_set_shared_entry(bool enable);
+
+/**
+ * Reserve a region to be backed by pages allocated on first write.
+ *
+ * Until a page is written to, it maps a single shared page of zeroes read
+ * only. Writable pages are allocated and zeroed by the page fault handler
+ * (see pager_resolve_cow). The region is released with pager_fly_unmap.
+ *
+ * @param void *page_tables - The page tables to map into, NULL for the current ones.
+ * @param uintptr_t virtual - The start of the region.
+ * @param size_t size - The size of the region in bytes.
+ * @param uint32_t attributes - The attributes of the pages, as for pager_fly_map.
+ * @return zero on success.
+ * */
+int pager_fly_map_lazy(void *page_tables, uintptr_t virtual, size_t size, uint32_t attributes);
+
+/**
+ * Duplicate a region of an address space, sharing its pages copy-on-write.
+ *
+ * The pages in the region are mapped read only in both page tables, and are
+ * only copied once they are written to (see pager_resolve_cow). Mappings
+ * are counted, so that pager_fly_unmap only frees a page along with its last
+ * mapping. Huge pages in the source are split.
+ *
+ * NOTE: Other page tables holding copies of the source's entries (such as
+ *       the kernel page tables of a process) keep their writable entries,
+ *       the caller has to unmap those.
+ *
+ * @param void *dest - The page tables to map the region into, NULL for the current ones.
+ * @param void *src - The page tables to duplicate from, NULL for the current ones.
+ * @param uintptr_t virtual - The start of the region.
+ * @param size_t size - The size of the region in bytes.
+ * @return zero on success.
+ * */
+int pager_clone_cow(void *dest, void *src, uintptr_t virtual, size_t size);
+
+/**
+ * Resolve a write fault on a copy-on-write page.
+ *
+ * The page is copied if it is still mapped elsewhere, otherwise the
+ * existing mapping is made writable. A lazily mapped page gets a zeroed
+ * page of its own.
+ *
+ * @param void *page_tables - The page tables the fault happened in, NULL for the current ones.
+ * @param uintptr_t virtual - The faulting address.
+ * @return zero if the fault was resolved, non-zero if it was not a copy-on-write fault.
+ * */
+int pager_resolve_cow(void *page_tables, uintptr_t virtual);
+
+/**
+ * Fill the pool of zeroed pages shared by all processors.
+ *
+ * Meant to be called while a processor is idle, so the pages of its own cache
+ * are handed to the pool as well. The pages are zeroed with non-temporal
+ * stores.
+ * */
+void pager_zero_cache_refill();
+
+/**
+ * Collapse page tables that map contiguous memory uniformly into huge pages.
+ *
+ * A page table whose 512 entries map contiguous, 2 MiB aligned physical
+ * memory with the same attributes is replaced by a single 2 MiB page. If
+ * a page directory then holds 512 such 2 MiB pages, and 1 GiB pages are
+ * supported, it is replaced by a single 1 GiB page. Pages with software
+ * bits set, and tables shared by pager_clone, are left alone.
+ *
+ * @param void *page_tables - The page tables to scan, NULL for the current ones.
+ * @param uintptr_t virtual - The start of the region to scan.
+ * @param size_t size - The size of the region to scan in bytes.
+ * @return the number of tables that were collapsed, negative on error.
+ * */
+int pager_collapse(void *page_tables, uintptr_t virtual, size_t size);
+
+/**
+ * Collapse the next part of the kernel's address space.
+ *
+ * Meant to be called repeatedly while a processor is idle, as smp_hold does
+ * on every idle tick. Each call scans the next 1 GiB of the higher half that
+ * is mapped, continuing from where the last call stopped and wrapping around
+ * at the top. Returns immediately if another processor is already scanning.
+ * */
+void pager_collapse_idle();
+
+/**
+ * Map scattered physical memory to a contiguous virtual range.
+ *
+ * The segments are mapped one after the other from the given address in a
+ * single walk of the page tables. Huge pages are used wherever a segment
+ * and the virtual address are aligned alike and the segment covers them.
+ *
+ * @param void *page_tables - The page tables to map into, NULL for the current ones.
+ * @param uintptr_t virtual - The address the first segment is mapped at.
+ * @param const ARC_PagerSegment *segments - The memory to map, each segment page aligned.
+ * @param size_t count - The number of segments.
+ * @param uint32_t attributes - The attributes to map with, as for pager_map.
+ * @return zero on success.
+ * */
+int pager_map_sg(void *page_tables, uintptr_t virtual, const ARC_PagerSegment *segments, size_t count, uint32_t attributes);
+
+/**
+ * Change the memory type of mapped pages.
+ *
+ * Meant for memory such as framebuffers that is mapped before it is known
+ * how it is best cached. Only the memory type of the pages changes, their
+ * other attributes stay.
+ * The pages are written back from and invalidated in the caches afterwards,
+ * so no line cached under the old type lingers. Unmapped parts of the range
+ * are skipped.
+ *
+ * @param void *page_tables - The page tables to change, NULL for the current ones.
+ * @param uintptr_t virtual - The start of the range.
+ * @param size_t size - The size of the range in bytes.
+ * @param uint32_t type - One of ARC_PAGER_MEM_*.
+ * @return zero on success.
+ * */
+int pager_set_memory_type(void *page_tables, uintptr_t virtual, size_t size, uint32_t type);
+
+/**
+ * Add up the paging counters of every processor.
+ *
+ * The counters are only ever incremented by their processor, so the sum
+ * may be slightly behind while other processors are running.
+ *
+ * @param ARC_PagerCounters *total - Set to the sum.
+ * */
+void pager_counters(ARC_PagerCounters *total);
+
+/**
+ * Describe the page tables of an address space.
+ *
+ * Every table is visited, so this is meant for diagnostics rather than
+ * anything frequent. The kernel's half is included, if it is shared its
+ * tables are counted in every address space.
+ *
+ * @param void *page_tables - The page tables to describe, NULL for the current ones.
+ * @param ARC_PagerStats *stats - Set to the description.
+ * @return zero on success.
+ * */
+int pager_stats(void *page_tables, ARC_PagerStats *stats);
+
+#endif
@@ -0,0 +1,102 @@
+/**
+ * @file pkey.h
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Karch-x86-64 - x86-64 Implementation of K/arch Abstractions
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Karch-x86-64.
+ *
+ * Arctan-OS/Karch-x86-64 is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Protection keys, which change the access rights of every page tagged
+ * with a key at once, without touching the page tables.
+*/
+#ifndef ARC_ARCH_X86_64_PKEY_H
+#define ARC_ARCH_X86_64_PKEY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ARC_PKEY_COUNT 16
+
+// Rights of a key, as held in PKRU and IA32_PKRS
+#define ARC_PKEY_ACCESS_DISABLE 0b01
+#define ARC_PKEY_WRITE_DISABLE  0b10
+
+// Rights a new context starts with, only key 0 is accessible
+#define ARC_PKEY_DEFAULT_RIGHTS 0x55555554
+
+/**
+ * Allocate a protection key.
+ *
+ * User keys (PKRU) apply to pages mapped with ARC_PAGER_US, supervisor
+ * keys (IA32_PKRS) to the others. Key 0 is never handed out, it is the key
+ * of every page mapped without one.
+ *
+ * @param bool supervisor - Allocate a supervisor key rather than a user key.
+ * @return the key, negative if none are left or keys are not supported.
+ * */
+int pkey_allocate(bool supervisor);
+
+/**
+ * Free a protection key.
+ *
+ * NOTE: Pages still tagged with the key keep it, and get the rights of
+ *       whoever allocates it next.
+ *
+ * @param int key - The key.
+ * @param bool supervisor - Whether it is a supervisor key.
+ * */
+void pkey_free(int key, bool supervisor);
+
+/**
+ * Set the rights the current thread has to the pages of a key.
+ *
+ * Only the protection key register of the current processor is written,
+ * it is saved and restored along with the thread's context.
+ *
+ * @param int key - The key.
+ * @param bool supervisor - Whether it is a supervisor key.
+ * @param uint32_t rights - ARC_PKEY_ACCESS_DISABLE and/or ARC_PKEY_WRITE_DISABLE, zero for full access.
+ * @return zero on success.
+ * */
+int pkey_set_rights(int key, bool supervisor, uint32_t rights);
+
+/**
+ * Get the rights the current thread has to the pages of a key.
+ *
+ * @param int key - The key.
+ * @param bool supervisor - Whether it is a supervisor key.
+ * @return the rights, negative on error.
+ * */
+int pkey_get_rights(int key, bool supervisor);
+
+uint32_t pkey_read_pkru();
+void pkey_write_pkru(uint32_t pkru);
+uint32_t pkey_read_pkrs();
+void pkey_write_pkrs(uint32_t pkrs);
+
+/**
+ * Enable protection keys on the current processor.
+ *
+ * Sets CR4.PKE if user keys are supported, and CR4.PKS if supervisor keys
+ * are.
+ * */
+void init_pkey();
+
+#endif
@@ -30,16 +30,33 @@
 #define ARC_ARCH_X86_64_SMP_H
 
 #include "arch/smp.h"
+#include "arch/x86-64/config.h"
 #include "arch/x86-64/gdt.h"
 #include "arch/x86-64/interrupt.h"
+#include "arch/x86-64/pager.h"
+#include "arch/x86-64/tlb.h"
 #include "arctan.h"
 
+// Vector of the LAPIC timer waking idle APs (see smp_hold)
+#define ARC_SMP_IDLE_VECTOR 0xFC
+
+typedef struct ARC_x64CachedTranslation {
+        uint64_t tables; // Physical address of the PML4
+        uint64_t virtual;
+        uint64_t entry; // The leaf entry mapping the page
+        uint32_t generation; // Of the pager's slot when looked up
+        uint16_t slot;
+        uint8_t level;
+} ARC_x64CachedTranslation;
+
 typedef struct ARC_x64ProcessorDescriptor {
         uintptr_t syscall_stack;
         uintptr_t rsp0;
         uintptr_t ist1;
         ARC_ProcessorDescriptor descriptor;
         ARC_ProcessorFeatures features;
+        // NUMA node the processor is on, ARC_NUMA_NO_NODE if not known
+        uint32_t numa_node;
         struct {
                 uint64_t *bmp;
                 int last_free;
@@ -50,6 +67,36 @@ typedef struct ARC_x64ProcessorDescriptor {
                 ARC_IDTEntry idt_entries[256];
                 ARC_TSSDescriptor tss;
         } proc_structs;
+        struct {
+                // Index of the processor in TLB CPU masks and mailboxes
+                uint32_t index;
+                uint32_t lapic;
+                // Bit n is set if the entries this processor holds for PCID n
+                // are up to date, meaning CR3 can be loaded with it without
+                // flushing
+                uint64_t valid[ARC_TLB_ADDRESS_SPACES / 64];
+                // The loaded page tables have the kernel's half, so entries
+                // into the kernel can stay on them (see tlb_enter)
+                bool shared;
+                // PCIDs are enabled and INVPCID is supported, so entries of
+                // address spaces that are not loaded can be invalidated
+                bool invpcid;
+                // Set by init_tlb once the fields above and the processor's
+                // mailbox are set up
+                bool registered;
+        } tlb;
+        struct {
+                // Stack of pages (HHDM addresses) that are already zeroed
+                void *pages[ARC_PAGER_ZERO_CACHE_SIZE];
+                uint32_t count;
+        } zero_cache;
+        struct {
+                // Recent translations of pager_query, indexed by virtual
+                // page
+                ARC_x64CachedTranslation entries[ARC_PAGER_XLAT_SIZE];
+        } xlat;
+        // Only ever written by this processor
+        ARC_PagerCounters counters;
 } __attribute__((packed,aligned(PAGE_SIZE))) ARC_x64ProcessorDescriptor;
 
 // NOTE: The index in Arc_ProcessorList corresponds to the ID
@@ -63,6 +110,33 @@ extern ARC_x64ProcessorDescriptor *Arc_BootProcessor;
 
 // The current processor descriptor
 extern ARC_x64ProcessorDescriptor __seg_gs *Arc_CurProcessorDescriptor;
+// The number of processors with a descriptor, the first being
+// Arc_BootProcessor and the rest in Arc_ProcessorList from index 1
+extern uint32_t Arc_ProcessorCounter;
+
+/**
+ * Whether the current processor is registered.
+ *
+ * The per-processor state in Arc_CurProcessorDescriptor (NUMA node, TLB
+ * state, zero cache, translation cache and counters) may only be used once
+ * this is true. init_tlb is the last to set any of it up.
+ *
+ * NOTE: Always inlined, so that it can be used from USERSPACE(text).
+ * */
+static inline __attribute__((always_inline)) bool smp_registered() {
+        // NOTE: GSBase is only set up once the BSP has registered, an AP
+        //       points it at its zeroed descriptor before registering
+        return Arc_ProcessorCounter > 0 && Arc_CurProcessorDescriptor->tlb.registered;
+}
+
+// Add to a counter of the current processor (see ARC_PagerCounters). A
+// single instruction, so it needs neither a lock nor interrupts disabled.
+#define ARC_PAGER_COUNT(counter, n) \
+        do { \
+                if (smp_registered()) { \
+                        Arc_CurProcessorDescriptor->counters.counter += (n); \
+                } \
+        } while (0)
 
 /**
  * Set the processor descriptor
@@ -0,0 +1,243 @@
+/**
+ * @file tlb.h
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Karch-x86-64 - x86-64 Implementation of K/arch Abstractions
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Karch-x86-64.
+ *
+ * Arctan-OS/Karch-x86-64 is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Structures and functions for batching TLB invalidations and shooting them
+ * down on other processors.
+*/
+#ifndef ARC_ARCH_X86_64_TLB_H
+#define ARC_ARCH_X86_64_TLB_H
+
+#include "arch/interrupt.h"
+#include "lib/spinlock.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARC_TLB_BATCH_RANGES 8
+#define ARC_TLB_MAILBOX_SIZE 16
+#define ARC_TLB_MAX_PROCESSORS 64
+#define ARC_TLB_ADDRESS_SPACES 4096
+#define ARC_TLB_SHOOTDOWN_VECTOR 0xFD
+
+// Address spaces are told apart by the PCID held in the lower 12 bits of
+// the page table pointer. Without PCIDs every address space is 0.
+#define ARC_TLB_ADDRESS_SPACE(_tables) ((uint32_t)((uintptr_t)(_tables) & 0xFFF))
+// Stands for every address space, for changes to tables that all of them
+// share. Batches for it must be local.
+#define ARC_TLB_ALL_ADDRESS_SPACES 0xFFFFFFFF
+
+typedef struct ARC_TLBRange {
+        uintptr_t base;
+        // Number of pages of 1 << shift bytes starting at base
+        uint32_t count;
+        uint32_t shift;
+} ARC_TLBRange;
+
+// NOTE: A batch records the pages that need to be invalidated over the
+//       course of an operation so that they can all be flushed at once.
+//       Adjacent pages of the same size are coalesced into ranges, once
+//       the ranges run out or the number of pages exceeds
+//       ARC_TLB_FLUSH_THRESHOLD the batch is marked as full and will be
+//       flushed with a single CR3 reload.
+typedef struct ARC_TLBBatch {
+        ARC_TLBRange ranges[ARC_TLB_BATCH_RANGES];
+        uint32_t range_count;
+        uint32_t pages;
+        // The address space the pages belong to
+        uint32_t pcid;
+        // Whether the address space is loaded on the current processor
+        bool local;
+        bool full;
+} ARC_TLBBatch;
+
+// NOTE: A range with a count of zero stands for the whole address space.
+typedef struct ARC_TLBMailboxEntry {
+        uint32_t pcid;
+        ARC_TLBRange range;
+} ARC_TLBMailboxEntry;
+
+// NOTE: Every processor has a mailbox that other processors append
+//       invalidation requests to before sending it an IPI. Each request
+//       bumps requested, once the owner has serviced everything up to
+//       a given request it sets completed to match, which is what the
+//       requesting processor waits on.
+typedef struct ARC_TLBMailbox {
+        ARC_Spinlock lock;
+        ARC_TLBMailboxEntry entries[ARC_TLB_MAILBOX_SIZE];
+        uint32_t count;
+        // More was requested than fits, drop everything
+        bool full;
+        uint64_t requested;
+        uint64_t completed;
+} __attribute__((aligned(64))) ARC_TLBMailbox;
+
+/**
+ * Invalidate a single page in the current address space.
+ *
+ * @param uintptr_t virtual - Any address within the page.
+ * */
+static inline void tlb_invalidate_page(uintptr_t virtual) {
+        __asm__ volatile("invlpg [%0]" :: "r"(virtual) : "memory");
+}
+
+/**
+ * Initialize a batch to be empty.
+ *
+ * @param ARC_TLBBatch *batch - The batch to initialize.
+ * @param uint32_t pcid - The address space the batch will be flushed in.
+ * @param bool local - Whether the address space is loaded on the current processor.
+ * */
+void tlb_batch_init(ARC_TLBBatch *batch, uint32_t pcid, bool local);
+
+/**
+ * Record a page to be invalidated.
+ *
+ * @param ARC_TLBBatch *batch - The batch to record the page into.
+ * @param uintptr_t virtual - The base address of the page.
+ * @param uint32_t shift - The size of the page as a power of two (12, 21, or 30).
+ * */
+void tlb_batch_add(ARC_TLBBatch *batch, uintptr_t virtual, uint32_t shift);
+
+/**
+ * Invalidate all pages recorded in the batch.
+ *
+ * The pages are invalidated on the current processor if the batch is local,
+ * and are shot down on every other processor that has the address space
+ * loaded. This function returns once all of them have acknowledged the
+ * request. The batch is emptied afterwards.
+ *
+ * @param ARC_TLBBatch *batch - The batch to flush.
+ * */
+void tlb_batch_flush(ARC_TLBBatch *batch);
+
+/**
+ * Prepare a value to be loaded into CR3 by the current processor.
+ *
+ * The processor is noted as holding entries of the address space, and will
+ * be sent shootdowns for it from here on. If PCIDs are enabled and the
+ * entries the processor holds for the address space are still up to date,
+ * bit 63 is set so that loading the value does not flush them.
+ *
+ * NOTE: This must be called with interrupts disabled, right before
+ *       the value is loaded.
+ *
+ * @param uint64_t cr3 - The value to be loaded into CR3.
+ * @return the value that should be loaded into CR3.
+ * */
+uint64_t tlb_prepare_cr3(uint64_t cr3);
+
+/**
+ * Prepare the page tables to enter the kernel on.
+ *
+ * Called by the interrupt and syscall stubs. If the loaded page tables
+ * share the kernel's half and tlb_set_shared_entry is in effect, the kernel
+ * runs on them and no CR3 load is needed.
+ *
+ * NOTE: This must be called with interrupts disabled.
+ *
+ * @param uint64_t cr3 - The kernel's page tables.
+ * @return the value to load into CR3, zero if CR3 is to be left alone.
+ * */
+uint64_t tlb_enter(uint64_t cr3);
+
+/**
+ * Prepare the page tables to return from the kernel to.
+ *
+ * The counterpart of tlb_enter, called by the stubs right before the saved
+ * CR3 is restored.
+ *
+ * NOTE: This must be called with interrupts disabled.
+ *
+ * @param uint64_t cr3 - The page tables to return to.
+ * @return the value to load into CR3, zero if they are already loaded.
+ * */
+uint64_t tlb_leave(uint64_t cr3);
+
+/**
+ * Let entries into the kernel stay on page tables that share its half.
+ *
+ * Only meant to be enabled where running the kernel on the tables of
+ * userspace is safe, see pager_set_shared_entry.
+ *
+ * @param bool enable - Whether to stay on shared page tables.
+ * */
+void tlb_set_shared_entry(bool enable);
+
+/**
+ * Let shootdowns target the current processor.
+ *
+ * Until then the processor is left out of them, as it would never answer
+ * the IPI with interrupts disabled. Everything it holds is flushed here.
+ *
+ * NOTE: Only to be called once the processor runs with interrupts enabled,
+ *       or services its mailbox wherever it waits with them disabled.
+ * */
+void tlb_set_interruptible();
+
+/**
+ * Drop everything any processor holds for the given address space.
+ *
+ * Meant to be used when a PCID is about to be reused.
+ *
+ * @param uint32_t pcid - The address space.
+ * */
+void tlb_invalidate_address_space(uint32_t pcid);
+
+/**
+ * Service all pending shootdown requests of the current processor.
+ * */
+void tlb_shootdown_service();
+
+/**
+ * Print the average number of cycles shootdowns have taken, by the number
+ * of processors they targeted.
+ * */
+void tlb_shootdown_report();
+
+/**
+ * Flush all non-global TLB entries of the current address space.
+ * */
+void tlb_flush_all();
+
+/**
+ * Flush all TLB entries, global ones included.
+ *
+ * Done by toggling CR4.PGE, which also flushes every other address space.
+ * Batches for ARC_TLB_ALL_ADDRESS_SPACES that are full are flushed this way,
+ * as the kernel's pages may be global.
+ * */
+void tlb_flush_global();
+
+void ARC_NAME_IRQ(tlb_shootdown_handler)();
+
+/**
+ * Register the current processor for TLB shootdowns.
+ *
+ * @return zero upon success.
+ * */
+int init_tlb();
+
+#endif
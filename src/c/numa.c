@@ -0,0 +1,478 @@
+/**
+ * @file numa.c
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Karch-x86-64 - x86-64 Implementation of K/arch Abstractions
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Karch-x86-64.
+ *
+ * Arctan-OS/Karch-x86-64 is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Parsing of the SRAT and SLIT, and allocation of memory on a given NUMA
+ * node.
+*/
+#include "arch/x86-64/config.h"
+#include "arch/x86-64/numa.h"
+#include "arctan.h"
+#include "global.h"
+#include "lib/spinlock.h"
+#include "util.h"
+#include <mm/pmm.h>
+
+#include <cpuid.h>
+#include <stdbool.h>
+
+#define NUMA_MAX_PROCESSORS 256
+
+#define SRAT_PROCESSOR 0
+#define SRAT_MEMORY 1
+#define SRAT_X2APIC 2
+
+struct srat_processor {
+        uint8_t type;
+        uint8_t length;
+        uint8_t domain_low;
+        uint8_t apic;
+        uint32_t flags;
+        uint8_t sapic_eid;
+        uint8_t domain_high[3];
+        uint32_t clock_domain;
+} __attribute__((packed));
+
+struct srat_memory {
+        uint8_t type;
+        uint8_t length;
+        uint32_t domain;
+        uint16_t resv0;
+        uint64_t base;
+        uint64_t size;
+        uint32_t resv1;
+        uint32_t flags;
+        uint64_t resv2;
+} __attribute__((packed));
+
+struct srat_x2apic {
+        uint8_t type;
+        uint8_t length;
+        uint16_t resv0;
+        uint32_t domain;
+        uint32_t apic;
+        uint32_t flags;
+        uint32_t clock_domain;
+        uint32_t resv1;
+} __attribute__((packed));
+
+// Only the parts of the table headers that are used
+struct acpi_header {
+        char signature[4];
+        uint32_t length;
+        uint8_t resv[28];
+} __attribute__((packed));
+
+struct numa_pool {
+        ARC_Spinlock lock;
+        void *pages; // Linked through their first word
+        uint32_t count;
+};
+
+// numa_domains[n] is the proximity domain of node n
+static uint32_t numa_domains[ARC_NUMA_MAX_NODES];
+static uint32_t numa_nodes = 0;
+static struct {
+        uint32_t apic;
+        uint32_t node;
+} numa_processors[NUMA_MAX_PROCESSORS];
+static uint32_t numa_processor_count = 0;
+static struct {
+        uint64_t base;
+        uint64_t size;
+        uint32_t node;
+} numa_ranges[ARC_NUMA_MAX_RANGES];
+static uint32_t numa_range_count = 0;
+static uint8_t numa_distances[ARC_NUMA_MAX_NODES][ARC_NUMA_MAX_NODES];
+static struct numa_pool numa_pools[ARC_NUMA_MAX_NODES];
+
+/**
+ * Get the node of a proximity domain, numbering it if it is new.
+ *
+ * @param uint32_t domain - The proximity domain.
+ * @return the node, ARC_NUMA_NO_NODE if there are too many.
+ * */
+static uint32_t numa_node_of_domain(uint32_t domain) {
+        for (uint32_t i = 0; i < numa_nodes; i++) {
+                if (numa_domains[i] == domain) {
+                        return i;
+                }
+        }
+
+        if (numa_nodes >= ARC_NUMA_MAX_NODES) {
+                ARC_DEBUG(WARN, "Too many NUMA nodes, ignoring proximity domain %d\n", domain);
+                return ARC_NUMA_NO_NODE;
+        }
+
+        numa_domains[numa_nodes] = domain;
+
+        return numa_nodes++;
+}
+
+static void numa_add_processor(uint32_t apic, uint32_t domain) {
+        uint32_t node = numa_node_of_domain(domain);
+
+        if (node == ARC_NUMA_NO_NODE || numa_processor_count >= NUMA_MAX_PROCESSORS) {
+                return;
+        }
+
+        numa_processors[numa_processor_count].apic = apic;
+        numa_processors[numa_processor_count].node = node;
+        numa_processor_count++;
+}
+
+int numa_parse_srat(const void *srat) {
+        const struct acpi_header *header = srat;
+
+        if (header == NULL || memcmp(header->signature, "SRAT", 4) != 0) {
+                ARC_DEBUG(ERR, "Not an SRAT\n");
+                return -1;
+        }
+
+        // Entries follow the header and 12 reserved bytes
+        const uint8_t *entry = (const uint8_t *)srat + sizeof(*header) + 12;
+        const uint8_t *end = (const uint8_t *)srat + header->length;
+
+        for (; entry + 2 <= end && entry[1] >= 2 && entry + entry[1] <= end; entry += entry[1]) {
+                switch (entry[0]) {
+                        case SRAT_PROCESSOR: {
+                                const struct srat_processor *processor = (const void *)entry;
+
+                                if ((processor->flags & 1) == 0) {
+                                        break;
+                                }
+
+                                uint32_t domain = processor->domain_low | (processor->domain_high[0] << 8)
+                                                  | (processor->domain_high[1] << 16) | ((uint32_t)processor->domain_high[2] << 24);
+                                numa_add_processor(processor->apic, domain);
+
+                                break;
+                        }
+
+                        case SRAT_X2APIC: {
+                                const struct srat_x2apic *processor = (const void *)entry;
+
+                                if ((processor->flags & 1) == 1) {
+                                        numa_add_processor(processor->apic, processor->domain);
+                                }
+
+                                break;
+                        }
+
+                        case SRAT_MEMORY: {
+                                const struct srat_memory *memory = (const void *)entry;
+
+                                if ((memory->flags & 1) == 0 || memory->size == 0) {
+                                        break;
+                                }
+
+                                uint32_t node = numa_node_of_domain(memory->domain);
+
+                                if (node == ARC_NUMA_NO_NODE) {
+                                        break;
+                                }
+
+                                if (numa_range_count >= ARC_NUMA_MAX_RANGES) {
+                                        ARC_DEBUG(WARN, "Too many NUMA memory ranges, ignoring 0x%"PRIx64" (0x%"PRIx64" B)\n", memory->base, memory->size);
+                                        break;
+                                }
+
+                                numa_ranges[numa_range_count].base = memory->base;
+                                numa_ranges[numa_range_count].size = memory->size;
+                                numa_ranges[numa_range_count].node = node;
+                                numa_range_count++;
+
+                                break;
+                        }
+                }
+        }
+
+        for (uint32_t i = 0; i < ARC_NUMA_MAX_NODES; i++) {
+                for (uint32_t j = 0; j < ARC_NUMA_MAX_NODES; j++) {
+                        // Until a SLIT says otherwise
+                        numa_distances[i][j] = i == j ? 10 : 20;
+                }
+
+                init_static_spinlock(&numa_pools[i].lock);
+        }
+
+        ARC_DEBUG(INFO, "%d NUMA node(s), %d processor(s), %d memory range(s)\n", numa_nodes, numa_processor_count, numa_range_count);
+
+        return 0;
+}
+
+int numa_parse_slit(const void *slit) {
+        const struct acpi_header *header = slit;
+
+        if (header == NULL || memcmp(header->signature, "SLIT", 4) != 0) {
+                ARC_DEBUG(ERR, "Not a SLIT\n");
+                return -1;
+        }
+
+        uint64_t localities = *(const uint64_t *)((const uint8_t *)slit + sizeof(*header));
+        const uint8_t *matrix = (const uint8_t *)slit + sizeof(*header) + sizeof(uint64_t);
+
+        if (sizeof(*header) + sizeof(uint64_t) + (localities * localities) > header->length) {
+                ARC_DEBUG(ERR, "SLIT is too short for %"PRIu64" localities\n", localities);
+                return -1;
+        }
+
+        for (uint32_t i = 0; i < numa_nodes; i++) {
+                for (uint32_t j = 0; j < numa_nodes; j++) {
+                        if (numa_domains[i] < localities && numa_domains[j] < localities) {
+                                numa_distances[i][j] = matrix[(numa_domains[i] * localities) + numa_domains[j]];
+                        }
+                }
+        }
+
+        return 0;
+}
+
+uint32_t numa_node_count() {
+        return numa_nodes;
+}
+
+uint32_t numa_node_of_processor(uint32_t apic) {
+        for (uint32_t i = 0; i < numa_processor_count; i++) {
+                if (numa_processors[i].apic == apic) {
+                        return numa_processors[i].node;
+                }
+        }
+
+        return ARC_NUMA_NO_NODE;
+}
+
+uint32_t numa_current_node() {
+        if (numa_nodes == 0) {
+                return ARC_NUMA_NO_NODE;
+        }
+
+        uint32_t eax, ebx, ecx, edx;
+        uint32_t apic = 0;
+
+        __cpuid(0, eax, ebx, ecx, edx);
+        uint32_t max_leaf = eax;
+
+        if (max_leaf >= 0xB) {
+                __cpuid_count(0xB, 0, eax, ebx, ecx, edx);
+        }
+
+        if (max_leaf >= 0xB && ebx != 0) {
+                // x2APIC ID
+                apic = edx;
+        } else {
+                __cpuid(1, eax, ebx, ecx, edx);
+                apic = ebx >> 24;
+        }
+
+        return numa_node_of_processor(apic);
+}
+
+uint32_t numa_node_of_memory(uintptr_t physical, size_t size) {
+        for (uint32_t i = 0; i < numa_range_count; i++) {
+                if (physical >= numa_ranges[i].base && physical - numa_ranges[i].base < numa_ranges[i].size) {
+                        uint64_t left = numa_ranges[i].size - (physical - numa_ranges[i].base);
+                        return size <= left ? numa_ranges[i].node : ARC_NUMA_NO_NODE;
+                }
+        }
+
+        return ARC_NUMA_NO_NODE;
+}
+
+uint8_t numa_distance(uint32_t from, uint32_t to) {
+        if (from >= numa_nodes || to >= numa_nodes) {
+                return from == to ? 10 : 20;
+        }
+
+        return numa_distances[from][to];
+}
+
+/**
+ * Keep a page for a processor of the node it is on.
+ *
+ * @param uint32_t node - The node of the page.
+ * @param void *page - The page.
+ * @return true if the page was kept.
+ * */
+static bool numa_pool_put(uint32_t node, void *page) {
+        struct numa_pool *pool = &numa_pools[node];
+        bool kept = false;
+
+        spinlock_lock(&pool->lock);
+
+        if (pool->count < ARC_NUMA_POOL_SIZE) {
+                *(void **)page = pool->pages;
+                pool->pages = page;
+                pool->count++;
+                kept = true;
+        }
+
+        spinlock_unlock(&pool->lock);
+
+        return kept;
+}
+
+static void *numa_pool_get(uint32_t node) {
+        struct numa_pool *pool = &numa_pools[node];
+
+        spinlock_lock(&pool->lock);
+
+        void *page = pool->pages;
+
+        if (page != NULL) {
+                pool->pages = *(void **)page;
+                pool->count--;
+        }
+
+        spinlock_unlock(&pool->lock);
+
+        return page;
+}
+
+/**
+ * Take a page kept for another node, the nearest one first.
+ *
+ * @param uint32_t node - The node the page is wanted on.
+ * @return the HHDM address of the page, NULL if every pool is empty.
+ * */
+static void *numa_pool_steal(uint32_t node) {
+        void *page = NULL;
+        bool taken[ARC_NUMA_MAX_NODES] = { 0 };
+
+        for (uint32_t n = 0; page == NULL && n < numa_nodes; n++) {
+                uint32_t nearest = ARC_NUMA_NO_NODE;
+
+                for (uint32_t i = 0; i < numa_nodes; i++) {
+                        if (!taken[i] && (nearest == ARC_NUMA_NO_NODE || numa_distance(node, i) < numa_distance(node, nearest))) {
+                                nearest = i;
+                        }
+                }
+
+                taken[nearest] = true;
+                page = numa_pool_get(nearest);
+        }
+
+        return page;
+}
+
+void *numa_page_alloc(uint32_t node) {
+        if (numa_nodes <= 1 || node >= numa_nodes) {
+                return pmm_fast_page_alloc();
+        }
+
+        void *page = numa_pool_get(node);
+
+        if (page != NULL) {
+                return page;
+        }
+
+        // Pages no other node has room for, given back at the end so they
+        // do not turn up again
+        void *rejected[ARC_NUMA_ALLOC_TRIES];
+        int count = 0;
+
+        for (int tries = 0; page == NULL && tries < ARC_NUMA_ALLOC_TRIES; tries++) {
+                void *candidate = pmm_fast_page_alloc();
+
+                if (candidate == NULL) {
+                        // Out of memory, the pages kept for other nodes
+                        // are better than nothing
+                        page = numa_pool_steal(node);
+                        break;
+                }
+
+                uint32_t owner = numa_node_of_memory(ARC_HHDM_TO_PHYS(candidate), PAGE_SIZE);
+
+                if (owner == node) {
+                        page = candidate;
+                } else if (owner == ARC_NUMA_NO_NODE || !numa_pool_put(owner, candidate)) {
+                        rejected[count++] = candidate;
+                }
+        }
+
+        int i = 0;
+
+        if (page == NULL && count > 0) {
+                // Nothing on the node, settle for the first page found
+                page = rejected[i++];
+        }
+
+        for (; i < count; i++) {
+                pmm_fast_page_free(rejected[i]);
+        }
+
+        return page;
+}
+
+size_t numa_drain_pools() {
+        size_t drained = 0;
+
+        for (uint32_t i = 0; i < numa_nodes; i++) {
+                void *page = NULL;
+
+                while ((page = numa_pool_get(i)) != NULL) {
+                        pmm_fast_page_free(page);
+                        drained++;
+                }
+        }
+
+        return drained;
+}
+
+void *numa_alloc(size_t size, uint32_t node) {
+        if (numa_nodes <= 1 || node >= numa_nodes) {
+                return pmm_alloc(size);
+        }
+
+        void *tried[ARC_NUMA_ALLOC_TRIES];
+        void *found = NULL;
+        int count = 0;
+
+        while (found == NULL && count < ARC_NUMA_ALLOC_TRIES) {
+                void *block = pmm_alloc(size);
+
+                if (block == NULL) {
+                        break;
+                }
+
+                if (numa_node_of_memory(ARC_HHDM_TO_PHYS(block), size) == node) {
+                        found = block;
+                } else {
+                        tried[count++] = block;
+                }
+        }
+
+        int i = 0;
+
+        if (found == NULL && count > 0) {
+                // Nothing on the node, settle for the first block found
+                found = tried[i++];
+        }
+
+        for (; i < count; i++) {
+                pmm_free(tried[i]);
+        }
+
+        return found;
+}
@@ -24,12 +24,19 @@
  *
  * @DESCRIPTION
 */
+#include "arch/info.h"
+#include "arch/smp.h"
 #include "arch/x86-64/config.h"
+#include "arch/x86-64/numa.h"
+#include "arch/x86-64/pager.h"
 #include "arch/x86-64/pcid.h"
 #include "arch/x86-64/smp.h"
+#include "arch/x86-64/tlb.h"
+#include "arch/x86-64/util.h"
 #include "arctan.h"
 #include "config.h"
 #include "lib/atomics.h"
+#include "lib/spinlock.h"
 #include "mm/allocator.h"
 #include "util.h"
 #include <arch/pager.h>
@@ -38,6 +45,7 @@
 #include <global.h>
 #include <lib/util.h>
 #include <stdint.h>
+#include <cpuid.h>
 
 // NOTE: The pager does not overwrite the priveleges of a directory table.
 //       So if a directory table is kernel only, and a userspace page is mapped
@@ -50,9 +58,65 @@
 #define ADDRESS_MASK 0x000FFFFFFFFFF000
 #define ONE_GIB 0x40000000
 #define TWO_MIB 0x200000
+#define ENTRY_SOFTWARE_BITS ((0b111ULL << 9) | (0x7FULL << 52))
+#define ENTRY_ACCESSED_DIRTY ((1ULL << 5) | (1ULL << 6))
+#define ENTRY_COW (1ULL << 9) // Shared page that is copied on the first write
+#define ENTRY_SHARED (1ULL << 10) // Shared read only page
+#define ENTRY_SHARED_TABLE (1ULL << 11) // Table shared with other page tables, copied before it is changed
+#define KERNEL_HALF 0xFFFF800000000000
+
+// The attributes of arch/x86-64/pager.h are placed by hand above the generic
+// ones of arch/pager.h, the PAT field being 3 bits wide
+#define PAGER_GENERIC_BELOW(bit) (ARC_PAGER_4K < (bit) && ARC_PAGER_US < (bit) && ARC_PAGER_RW < (bit) \
+				  && ARC_PAGER_NX < (bit) && ARC_PAGER_OVW < (bit) && ARC_PAGER_RESV0 < (bit) \
+				  && ARC_PAGER_RESV1 < (bit) && ARC_PAGER_RESV2 < (bit) && ARC_PAGER_PAT + 2 < (bit) \
+				  && ARC_PAGER_AUTO_USRW_DISABLE < (bit))
+_Static_assert(PAGER_GENERIC_BELOW(ARC_PAGER_PKEY), "ARC_PAGER_PKEY overlaps the generic pager attributes");
+_Static_assert(PAGER_GENERIC_BELOW(ARC_PAGER_GLOBAL) && ARC_PAGER_GLOBAL >= ARC_PAGER_PKEY + 4 && ARC_PAGER_GLOBAL < 32,
+	       "ARC_PAGER_GLOBAL overlaps other pager attributes");
 
 uintptr_t USERSPACE(bss) Arc_KernelPageTables = 0;
 
+// Number of mappings of each physical page mapped more than once by
+// pager_clone_cow
+struct pager_share {
+	uintptr_t physical;
+	uint64_t count;
+	struct pager_share *next;
+};
+
+static struct pager_share *pager_shares[ARC_PAGER_SHARE_BUCKETS] = { 0 };
+static ARC_Spinlock pager_share_lock;
+
+// Set once every PML4 entry of the kernel's half of Arc_KernelPageTables is
+// present, after which the entries never change and are copied into new
+// page tables
+static bool pager_kernel_half_shared = false;
+static bool pager_share_kernel = false;
+// Whether mappings in the kernel's half are made global. Only done when the
+// kernel's half is shared, as otherwise global entries would outlive the
+// switch to page tables that do not map the kernel.
+static bool pager_global = false;
+static ARC_Spinlock pager_kernel_half_lock;
+
+// Walkers of the tables below a PML4 entry, keyed by the PML3 it points to
+// so the kernel's half is guarded the same in every page table. Walkers only
+// count themselves in, the tables are only freed by whoever manages to set
+// PAGER_SLOT_WRITER while no walker is in. The generation changes whenever
+// the tables may have been changed, which is what cached translations of
+// pager_query are checked against.
+#define PAGER_SLOT_WRITER 0x80000000
+struct pager_slot {
+	uint32_t users;
+	uint32_t generation;
+};
+
+static struct pager_slot pager_slots[ARC_PAGER_SLOT_LOCKS] = { 0 };
+
+// Physical address of the page of zeroes lazy mappings point to until they
+// are written to, it is never counted or freed
+static uint64_t pager_zero_page = 0;
+
 struct pager_traverse_info {
 	uint64_t *src_table; // Source page tables
 	uint64_t *dest_table; // Destination page tables
@@ -65,6 +129,19 @@ struct pager_traverse_info {
 	uint32_t pml3e;
 	uint32_t pml2e;
 	uint32_t pml1e;
+	uint32_t bulk_max; // Consecutive entries the callback may handle, from the given index
+	uint32_t bulk_done; // Consecutive entries the callback handled, one unless it sets it
+	bool any_physical; // Physical addresses do not need to be aligned to map huge pages
+	bool prune; // Free the tables left empty by the traversal
+	bool no_split; // Hand huge pages to the callback whole, even if the range covers them partly
+	bool clear; // Clear the bits pager_harvest collects
+	bool keep_shared; // Do not unshare tables on the way, nothing below is changed
+	uint64_t *accessed; // Bitmaps pager_harvest fills, one bit per 4 KiB page
+	uint64_t *dirty;
+	const ARC_PagerSegment *segments; // Physical memory mapped by pager_map_sg, physical is in the first
+	size_t segment_count;
+	size_t segment_left; // Bytes left in the first segment
+	ARC_TLBBatch batch; // Pages to invalidate once the traversal is done
 };
 
 uint64_t get_entry_bits(uint32_t level, uint32_t attributes) {
@@ -76,38 +153,43 @@ uint64_t get_entry_bits(uint32_t level, uint32_t attributes) {
 
 	uint64_t bits = 0;
 
-	bits |= ((attributes >> (ARC_PAGER_PAT)) & 1) << 2; // PWT
-	bits |= ((attributes >> (ARC_PAGER_PAT + 1)) & 1) << 3; // PCD
-
 	int us_rw_overwrite = (level > MASKED_READ(attributes, ARC_PAGER_AUTO_USRW_DISABLE, 0xF) + 1);
 
+	// Bits that only mean something in entries that map pages
+	uint64_t leaf = (uint64_t)MASKED_READ(attributes, ARC_PAGER_PKEY, 0xF) << 59;
+	leaf |= (uint64_t)(MASKED_READ(attributes, ARC_PAGER_GLOBAL, 1) & pager_global) << 8;
+	// The memory type, table entries leave the tables write back
+	leaf |= ((attributes >> (ARC_PAGER_PAT)) & 1) << 3; // PWT
+	leaf |= ((attributes >> (ARC_PAGER_PAT + 1)) & 1) << 4; // PCD
+	uint64_t pat = (attributes >> (ARC_PAGER_PAT + 2)) & 1;
+
 	switch (level) {
 		case 1: {
-			// PAT
-			bits |= ((attributes >> (ARC_PAGER_PAT + 2)) & 1) << 7;
+			bits |= pat << 7;
+			bits |= leaf;
 
 			break;
 		}
 
 		case 2: {
-			// PAT
-			bits |= ((attributes >> (ARC_PAGER_PAT + 2)) & 1) << 12;
 			// 2MiB pages unless 4K specified
 			if (((attributes >> ARC_PAGER_RESV1) & 1) == 1) {
 				us_rw_overwrite = 0;
 				bits |= 1 << 7;
+				bits |= pat << 12;
+				bits |= leaf;
 			}
 
 			break;
 		}
 
 		case 3: {
-			// PAT
-			bits |= ((attributes >> (ARC_PAGER_PAT + 2)) & 1) << 12;
 			// 1GiB pages unless 4K specified
  			if (((attributes >> ARC_PAGER_RESV0) & 1) == 1) {
 				us_rw_overwrite = 0;
 				bits |= 1 << 7;
+				bits |= pat << 12;
+				bits |= leaf;
 			}
 
 			break;
@@ -130,6 +212,340 @@ uint64_t get_entry_bits(uint32_t level, uint32_t attributes) {
 	return bits;
 }
 
+// Zeroed pages any processor may take, filled by idle processors for the
+// busy ones. Linked through their first word, which is cleared when taken.
+static void *pager_zero_pool = NULL;
+static uint32_t pager_zero_pool_count = 0;
+static ARC_Spinlock pager_zero_pool_lock;
+
+/**
+ * Take a page from the shared pool of zeroed pages.
+ *
+ * @return the HHDM address of the page, NULL if the pool is empty.
+ * */
+static void *pager_zero_pool_get() {
+	if (__atomic_load_n(&pager_zero_pool_count, __ATOMIC_RELAXED) == 0) {
+		return NULL;
+	}
+
+	bool I = arch_interrupts_enabled();
+	ARC_DISABLE_INTERRUPT;
+	spinlock_lock(&pager_zero_pool_lock);
+
+	uint64_t *page = pager_zero_pool;
+
+	if (page != NULL) {
+		pager_zero_pool = (void *)page[0];
+		pager_zero_pool_count--;
+		page[0] = 0;
+	}
+
+	spinlock_unlock(&pager_zero_pool_lock);
+
+	if (I) {
+		ARC_ENABLE_INTERRUPT;
+	}
+
+	return page;
+}
+
+/**
+ * Put a page into the shared pool of zeroed pages.
+ *
+ * @param void *page - The HHDM address of the page.
+ * @return true if the page was kept.
+ * */
+static bool pager_zero_pool_put(void *page) {
+	bool kept = false;
+
+	bool I = arch_interrupts_enabled();
+	ARC_DISABLE_INTERRUPT;
+	spinlock_lock(&pager_zero_pool_lock);
+
+	if (pager_zero_pool_count < ARC_PAGER_ZERO_POOL_SIZE) {
+		*(void **)page = pager_zero_pool;
+		pager_zero_pool = page;
+		pager_zero_pool_count++;
+		kept = true;
+	}
+
+	spinlock_unlock(&pager_zero_pool_lock);
+
+	if (I) {
+		ARC_ENABLE_INTERRUPT;
+	}
+
+	return kept;
+}
+
+/**
+ * Allocate a page on the node of the current processor.
+ *
+ * Page tables are walked by the processors that use them, which are most
+ * likely the one that creates them.
+ *
+ * @return the HHDM address of the page, NULL on failure.
+ * */
+static void *pager_page_alloc() {
+	uint32_t node = ARC_NUMA_NO_NODE;
+
+	if (smp_registered()) {
+		node = Arc_CurProcessorDescriptor->numa_node;
+	}
+
+	return numa_page_alloc(node);
+}
+
+/**
+ * Allocate a zeroed page.
+ *
+ * The page is taken from the current processor's cache of zeroed pages,
+ * then from the pool idle processors fill, and is only allocated and zeroed
+ * here if both are empty.
+ *
+ * @return the HHDM address of the page, NULL on failure.
+ * */
+static void *pager_alloc_zeroed() {
+	void *page = NULL;
+
+	if (smp_registered()) {
+		bool I = arch_interrupts_enabled();
+		ARC_DISABLE_INTERRUPT;
+
+		uint32_t count = Arc_CurProcessorDescriptor->zero_cache.count;
+
+		if (count > 0) {
+			page = Arc_CurProcessorDescriptor->zero_cache.pages[count - 1];
+			Arc_CurProcessorDescriptor->zero_cache.count = count - 1;
+		}
+
+		if (I) {
+			ARC_ENABLE_INTERRUPT;
+		}
+	}
+
+	if (page == NULL) {
+		page = pager_zero_pool_get();
+	}
+
+	if (page != NULL) {
+		return page;
+	}
+
+	page = pager_page_alloc();
+
+	if (page != NULL) {
+		memset(page, 0, PAGE_SIZE);
+	}
+
+	return page;
+}
+
+/**
+ * Free a page that is entirely zero.
+ *
+ * The page goes back into the current processor's cache if there is room,
+ * otherwise into the shared pool.
+ *
+ * @param void *page - The HHDM address of the page.
+ * */
+static void pager_free_zeroed(void *page) {
+	bool cached = false;
+
+	if (smp_registered()) {
+		bool I = arch_interrupts_enabled();
+		ARC_DISABLE_INTERRUPT;
+
+		uint32_t count = Arc_CurProcessorDescriptor->zero_cache.count;
+
+		if (count < ARC_PAGER_ZERO_CACHE_SIZE) {
+			Arc_CurProcessorDescriptor->zero_cache.pages[count] = page;
+			Arc_CurProcessorDescriptor->zero_cache.count = count + 1;
+			cached = true;
+		}
+
+		if (I) {
+			ARC_ENABLE_INTERRUPT;
+		}
+	}
+
+	if (!cached && !pager_zero_pool_put(page)) {
+		pmm_fast_page_free(page);
+	}
+}
+
+void pager_zero_cache_refill() {
+	if (!smp_registered()) {
+		return;
+	}
+
+	// An idle processor has no use for pages of its own, hand them to the
+	// processors that are busy
+	for (;;) {
+		bool I = arch_interrupts_enabled();
+		ARC_DISABLE_INTERRUPT;
+
+		uint32_t count = Arc_CurProcessorDescriptor->zero_cache.count;
+		void *page = NULL;
+
+		if (count > 0 && __atomic_load_n(&pager_zero_pool_count, __ATOMIC_RELAXED) < ARC_PAGER_ZERO_POOL_SIZE) {
+			page = Arc_CurProcessorDescriptor->zero_cache.pages[count - 1];
+			Arc_CurProcessorDescriptor->zero_cache.count = count - 1;
+		}
+
+		if (I) {
+			ARC_ENABLE_INTERRUPT;
+		}
+
+		if (page == NULL) {
+			break;
+		}
+
+		if (!pager_zero_pool_put(page)) {
+			pager_free_zeroed(page);
+			break;
+		}
+	}
+
+	while (__atomic_load_n(&pager_zero_pool_count, __ATOMIC_RELAXED) < ARC_PAGER_ZERO_POOL_SIZE) {
+		uint64_t *page = (uint64_t *)pager_page_alloc();
+
+		if (page == NULL) {
+			return;
+		}
+
+		// Non-temporal stores keep the zeroes from evicting anything
+		// useful from the cache
+		for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i += 4) {
+			__asm__("movnti [%0], %1; \
+				 movnti [%0 + 8], %1; \
+				 movnti [%0 + 16], %1; \
+				 movnti [%0 + 24], %1" :: "r"(&page[i]), "r"(0ULL) : "memory");
+		}
+
+		__asm__("sfence" ::: "memory");
+
+		if (!pager_zero_pool_put(page)) {
+			pager_free_zeroed(page);
+			return;
+		}
+	}
+}
+
+/**
+ * Split a 1 GiB or 2 MiB page into a table of smaller pages.
+ *
+ * The new table maps the same memory with the same attributes, so the
+ * smaller pages can then be changed individually.
+ *
+ * @param uint64_t *parent - The table holding the huge page.
+ * @param int level - The level of the parent table (3 for 1 GiB, 2 for 2 MiB).
+ * @param int index - The index of the huge page in the parent.
+ * @param uint64_t entry - The huge page entry as it was read.
+ * @return zero on success, or if another processor changed the entry first.
+ * */
+static int pager_split(uint64_t *parent, int level, int index, uint64_t entry) {
+	uint64_t *table = (uint64_t *)pager_page_alloc();
+
+	if (table == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate table to split page\n");
+		return -1;
+	}
+
+	uint64_t size = level == 3 ? ONE_GIB : TWO_MIB;
+	uint64_t step = size >> 9;
+	uint64_t address = entry & ADDRESS_MASK & ~(size - 1);
+	uint64_t bits = entry & ~(ADDRESS_MASK & ~(size - 1));
+
+	if (level == 2) {
+		// 4K pages have no page size bit, and have the PAT bit where the
+		// page size bit was
+		bits &= ~((1ULL << 7) | (1ULL << 12));
+		bits |= ((entry >> 12) & 1) << 7;
+	}
+
+	for (int i = 0; i < 512; i++) {
+		table[i] = (address + (i * step)) | bits;
+	}
+
+	// NOTE: The directory entry gives every permission, the pages in the
+	//       new table keep the original ones. The huge page is invalidated
+	//       along with whichever of the smaller pages is later changed, as
+	//       they inherit its accessed bit.
+	uint64_t new = (uint64_t)ARC_HHDM_TO_PHYS(table) | 0b111;
+
+	if (!__atomic_compare_exchange_n(&parent[index], &entry, new, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		// The huge page was changed, whatever is there now is used
+		pmm_fast_page_free(table);
+		return 0;
+	}
+
+	ARC_PAGER_COUNT(tables_allocated, 1);
+	ARC_PAGER_COUNT(splits, 1);
+
+	return 0;
+}
+
+/**
+ * Get the slot guarding the tables below a PML4 entry.
+ *
+ * @param uint64_t entry - The PML4 entry.
+ * @return the slot.
+ * */
+static inline struct pager_slot *pager_slot(uint64_t entry) {
+	uint64_t hash = ((entry & ADDRESS_MASK) >> PAGE_SIZE_LOWEST_EXPONENT) * 0x9E3779B97F4A7C15ULL;
+	return &pager_slots[(hash >> 32) & (ARC_PAGER_SLOT_LOCKS - 1)];
+}
+
+static void pager_slot_enter(struct pager_slot *slot) {
+	uint32_t users = __atomic_load_n(&slot->users, __ATOMIC_RELAXED);
+
+	for (;;) {
+		if (users & PAGER_SLOT_WRITER) {
+			__asm__("pause");
+			users = __atomic_load_n(&slot->users, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		if (__atomic_compare_exchange_n(&slot->users, &users, users + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+}
+
+/**
+ * Leave a slot entered with pager_slot_enter.
+ *
+ * @param struct pager_slot *slot - The slot.
+ * @param bool changed - Whether entries below the slot may have been changed.
+ * */
+static void pager_slot_leave(struct pager_slot *slot, bool changed) {
+	if (changed) {
+		__atomic_fetch_add(&slot->generation, 1, __ATOMIC_RELEASE);
+	}
+
+	__atomic_fetch_sub(&slot->users, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Try to get sole access to the tables below a PML4 entry.
+ *
+ * NOTE: Interrupts must be disabled until pager_slot_unlock, as a walk
+ *       started on this processor would wait forever.
+ *
+ * @param struct pager_slot *slot - The slot.
+ * @return true if no walker was in.
+ * */
+static bool pager_slot_try_lock(struct pager_slot *slot) {
+	uint32_t users = 0;
+	return __atomic_compare_exchange_n(&slot->users, &users, PAGER_SLOT_WRITER, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void pager_slot_unlock(struct pager_slot *slot) {
+	__atomic_fetch_add(&slot->generation, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&slot->users, 0, __ATOMIC_RELEASE);
+}
+
 /**
  * Get the next page table.
  *
@@ -147,9 +563,7 @@ static int get_page_table(uint64_t *parent, int level, uintptr_t virtual, uint32
 	}
 	int shift = ((level - 1) * 9) + 12;
 	int index = (virtual >> shift) & 0x1FF;
-	uint64_t entry = parent[index];
-
-	uint64_t *address = (uint64_t *)(entry & 0x0000FFFFFFFFF000);
+	uint64_t entry = __atomic_load_n(&parent[index], __ATOMIC_ACQUIRE);
 
 	/*
 		Level | Decsription
@@ -167,8 +581,17 @@ static int get_page_table(uint64_t *parent, int level, uintptr_t virtual, uint32
 	bool can_gib = MASKED_READ(attributes, ARC_PAGER_RESV0, 1);
 	bool can_mib = MASKED_READ(attributes, ARC_PAGER_RESV1, 1);
 	bool no_create = MASKED_READ(attributes, ARC_PAGER_RESV2, 1);
+	bool descend = level != 1 && ((level == 4) || (level == 3 && !can_gib) || (level == 2 && !can_mib) || only_4k);
+
+	if (present && descend && (level == 3 || level == 2) && ((entry >> 7) & 1)) {
+		// The walk has to go below a huge page, split it so only the
+		// part that is being operated on changes
+		if (pager_split(parent, level, index, entry) != 0) {
+			return -1;
+		}
+	}
 
-	if (!no_create && !present && level != 1 && ((level == 4) || (level == 3 && !can_gib) || (level == 2 && !can_mib) || only_4k)) {
+	if (!no_create && !present && descend) {
 		// Only make a new table if:
 		//     The current entry is not present AND:
 		//         - Mapping is only 4K, or
@@ -177,415 +600,2143 @@ static int get_page_table(uint64_t *parent, int level, uintptr_t virtual, uint32
 		//         - Parent is a level 2 page table
 		//     AND creation of page tables is allowed
 		//     AND not on page level
-		address = (uint64_t *)pmm_fast_page_alloc();
+		uint64_t *address = (uint64_t *)pager_alloc_zeroed();
 
 		if (address == NULL) {
 			ARC_DEBUG(ERR, "Can't alloc\n");
 			return -1;
 		}
 
-		memset(address, 0, PAGE_SIZE);
-		parent[index] = (uint64_t)ARC_HHDM_TO_PHYS(address) | get_entry_bits(level, attributes);
+		uint64_t new = (uint64_t)ARC_HHDM_TO_PHYS(address) | get_entry_bits(level, attributes);
+
+		if (!__atomic_compare_exchange_n(&parent[index], &entry, new, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			// Another processor installed a table first, use that one
+			pager_free_zeroed(address);
+		} else {
+			ARC_PAGER_COUNT(tables_allocated, 1);
+		}
 	}
 
 	return index;
 }
 
 /**
- * Standard function to traverse x86-64 page tables
+ * Record the page currently being traversed to be invalidated.
  *
- * @param struct pager_traverse_info *info - Information to use for traversing and to pass to the callback.
- * @param int *(callback)(...) - The callback function.
- * @return zero on success.
+ * @param struct pager_traverse_info *info - The current traversal.
+ * @param int level - The level of the table holding the page's entry.
  * */
-static int pager_traverse(struct pager_traverse_info *info, int (*callback)(struct pager_traverse_info *info, uint64_t *table, int index, int level)) {
-	if (info == NULL || info->dest_table == NULL) {
-		return -1;
-	}
-
-	info->size = ALIGN_UP(info->size, PAGE_SIZE);
+static void pager_invalidate(struct pager_traverse_info *info, int level) {
+	tlb_batch_add(&info->batch, info->virtual, ((level - 1) * 9) + 12);
+}
 
-	while (info->size) {
-		bool can_gib = ARC_CHECK_FEATURE(paging, ARC_PAGER_FLAG_GIB)
-   			       && !MASKED_READ(info->attributes, ARC_PAGER_4K, 1)
-			       && (info->size >= ONE_GIB);
-		bool can_2mib = (info->size >= TWO_MIB)
-				&& !MASKED_READ(info->attributes, ARC_PAGER_4K, 1);
+/**
+ * Replace an entry.
+ *
+ * The processor may set the accessed and dirty bits of a present entry at
+ * any time, so a present entry is exchanged atomically for the caller to
+ * know for sure whether it may have been cached.
+ *
+ * NOTE: A not present entry is replaced with a plain store, two processors
+ *       mapping the same page at the same time is up to the caller.
+ *
+ * @param uint64_t *entry - The entry to replace.
+ * @param uint64_t value - The new value of the entry.
+ * @return the old value of the entry.
+ * */
+static inline uint64_t pager_set_entry(uint64_t *entry, uint64_t value) {
+	uint64_t old = __atomic_load_n(entry, __ATOMIC_RELAXED);
 
-		MASKED_WRITE(info->attributes, can_gib, ARC_PAGER_RESV0, 1);
-		MASKED_WRITE(info->attributes, can_2mib, ARC_PAGER_RESV1, 1);
+	if ((old & 1) == 0) {
+		__atomic_store_n(entry, value, __ATOMIC_RELEASE);
+		return old;
+	}
 
-		uint64_t *table = (uint64_t *)ALIGN_DOWN(info->dest_table, PAGE_SIZE); // PML4
-										       // Align down is used to cut out
-										       // the PCID
-		int index = get_page_table(table, 4, info->virtual, info->attributes); // index in PML4
+	return __atomic_exchange_n(entry, value, __ATOMIC_ACQ_REL);
+}
 
-		if (index == -1) {
-			return -2;
+/**
+ * Fill consecutive entries of a table with a physically contiguous run.
+ *
+ * The bits of the entries are only computed once, the addresses are derived
+ * from the first one.
+ *
+ * @param struct pager_traverse_info *info - The current traversal.
+ * @param uint64_t *table - The table holding the entries.
+ * @param int index - The first entry to fill.
+ * @param int level - The level of the table.
+ * @param uint32_t count - The number of entries to fill.
+ * */
+static void pager_fill_entries(struct pager_traverse_info *info, uint64_t *table, int index, int level, uint32_t count) {
+	int shift = ((level - 1) * 9) + 12;
+	uint64_t step = 1ULL << shift;
+	uint64_t entry = info->physical | get_entry_bits(level, info->attributes);
+	uint64_t *dest = &table[index];
+	uint64_t old = 0;
+	uint32_t i = 0;
+
+	// NOTE: SSE and AVX are not used as the kernel does not save those
+	//       registers for itself. Plain stores unrolled by four keep the
+	//       loop bound by the stores, present entries are exchanged.
+	for (; i + 4 <= count; i += 4) {
+		if (((dest[i] | dest[i + 1] | dest[i + 2] | dest[i + 3]) & 1) == 1) {
+			break;
 		}
 
-		info->pml4e = index;
+		dest[i] = entry;
+		dest[i + 1] = entry + step;
+		dest[i + 2] = entry + (step * 2);
+		dest[i + 3] = entry + (step * 3);
+		entry += step * 4;
+	}
 
-		table = (uint64_t *)ARC_PHYS_TO_HHDM(table[index] & ADDRESS_MASK); // PML4[index] -> PML3
-		index = get_page_table(table, 3, info->virtual, info->attributes); // index in PML3
+	for (; i < count; i++) {
+		old |= pager_set_entry(&dest[i], entry);
+		entry += step;
+	}
 
-		if (index == -1) {
-			return -3;
+	// Only if one of the old entries was accessed can the run be cached
+	if ((old >> 5) & 1) {
+		for (i = 0; i < count; i++) {
+			tlb_batch_add(&info->batch, info->virtual + (i * step), shift);
 		}
+	}
+}
+
+/**
+ * Make every PML4 entry of the kernel's half of Arc_KernelPageTables present.
+ *
+ * @return true if the kernel's half can be shared.
+ * */
+static bool pager_prepare_kernel_half() {
+	if (__atomic_load_n(&pager_kernel_half_shared, __ATOMIC_ACQUIRE)) {
+		return true;
+	}
 
-		info->pml3e = index;
+	if (!pager_share_kernel || Arc_KernelPageTables == 0) {
+		return false;
+	}
 
-		if (can_gib) {
-			// Map 1 GiB page
-			if (callback(info, table, index, 3) != 0) {
-				return -4;
-			}
+	spinlock_lock(&pager_kernel_half_lock);
 
-			info->virtual += ONE_GIB;
-			info->physical += ONE_GIB;
-			info->size -= ONE_GIB;
+	uint64_t *kernel = (uint64_t *)ALIGN_DOWN(ARC_PHYS_TO_HHDM(Arc_KernelPageTables), PAGE_SIZE);
+	bool ready = true;
 
+	for (int i = 256; i < 512 && !pager_kernel_half_shared; i++) {
+		if ((kernel[i] & 1) == 1) {
 			continue;
 		}
 
-		table = (uint64_t *)ARC_PHYS_TO_HHDM(table[index] & ADDRESS_MASK);
-		index = get_page_table(table, 2, info->virtual, info->attributes);
+		void *pml3 = pager_alloc_zeroed();
 
-		if (index == -1) {
-			return -5;
+		if (pml3 == NULL) {
+			ARC_DEBUG(ERR, "Failed to allocate PML3 for kernel half\n");
+			ready = false;
+			break;
 		}
 
-		info->pml2e = index;
+		kernel[i] = ARC_HHDM_TO_PHYS(pml3) | get_entry_bits(4, 1 << ARC_PAGER_RW);
+	}
 
-		if (can_2mib) {
-			// Map 2 MiB page
-			if (callback(info, table, index, 2) != 0) {
-				return -6;
-			}
+	if (ready) {
+		__atomic_store_n(&pager_kernel_half_shared, true, __ATOMIC_RELEASE);
+	}
 
-			info->virtual += TWO_MIB;
-			info->physical += TWO_MIB;
-			info->size -= TWO_MIB;
+	spinlock_unlock(&pager_kernel_half_lock);
 
-			continue;
-		}
+	return ready;
+}
 
-		table = (uint64_t *)ARC_PHYS_TO_HHDM(table[index] & ADDRESS_MASK);
-		index = get_page_table(table, 1, info->virtual, info->attributes);
+bool pager_shares_kernel_half(void *page_tables) {
+	if (!__atomic_load_n(&pager_kernel_half_shared, __ATOMIC_ACQUIRE) || page_tables == NULL) {
+		return false;
+	}
 
-		if (index == -1) {
-			return -7;
-		}
+	uint64_t *kernel = (uint64_t *)ALIGN_DOWN(ARC_PHYS_TO_HHDM(Arc_KernelPageTables), PAGE_SIZE);
+	uint64_t *tables = (uint64_t *)ALIGN_DOWN(page_tables, PAGE_SIZE);
 
-		info->pml1e = index;
+	// The entries are either all copied at creation or none of them are
+	return tables[511] == kernel[511] && tables[256] == kernel[256];
+}
 
-		// Map 4K page
-		if (callback(info, table, index, 1) != 0) {
-			return -8;
-		}
+/**
+ * Find the share count of a physical page.
+ *
+ * NOTE: The share lock must be held.
+ *
+ * @param uintptr_t physical - The physical page.
+ * @param struct pager_share ***link - Set to the link pointing to the count, or to where it would go.
+ * @return the count, NULL if the page is not shared.
+ * */
+static struct pager_share *pager_share_find(uintptr_t physical, struct pager_share ***link) {
+	uint64_t hash = (physical >> PAGE_SIZE_LOWEST_EXPONENT) * 0x9E3779B97F4A7C15ULL;
+	struct pager_share **current = &pager_shares[(hash >> 32) & (ARC_PAGER_SHARE_BUCKETS - 1)];
 
-		info->virtual += PAGE_SIZE;
-		info->physical += PAGE_SIZE;
-		info->size -= PAGE_SIZE;
+	while (*current != NULL && (*current)->physical != physical) {
+		current = &(*current)->next;
 	}
 
-	return 0;
+	*link = current;
+
+	return *current;
 }
 
-void *pager_create_page_tables() {
-	int pcid = 0;
+/**
+ * Count another mapping of a physical page.
+ *
+ * NOTE: The share lock must be held.
+ *
+ * @param uintptr_t physical - The physical page.
+ * @return zero on success.
+ * */
+static int pager_share_get_locked(uintptr_t physical) {
+	struct pager_share **link = NULL;
+	struct pager_share *share = pager_share_find(physical, &link);
 
-	if (ARC_CHECK_FEATURE(paging, ARC_PAGER_FLAG_PCID)) {
-		pcid = pcid_allocate();
+	if (share == NULL) {
+		share = alloc(sizeof(*share));
 
-		if (pcid < 0) {
-			ARC_DEBUG(ERR, "Failed to allocate PCID\n");
-			return NULL;
+		if (share == NULL) {
+			ARC_DEBUG(ERR, "Failed to allocate share count\n");
+			return -1;
 		}
+
+		// The page was only mapped once before this
+		share->physical = physical;
+		share->count = 1;
+		share->next = NULL;
+		*link = share;
 	}
 
-	void *tables = pmm_fast_page_alloc();
+	share->count++;
 
-	if (tables == NULL) {
-		return NULL;
+	return 0;
+}
+
+/**
+ * Drop a mapping of a physical page.
+ *
+ * NOTE: The share lock must be held.
+ *
+ * @param uintptr_t physical - The physical page.
+ * @return true if it was the last mapping, in which case the page is owned by the caller.
+ * */
+static bool pager_share_put_locked(uintptr_t physical) {
+	struct pager_share **link = NULL;
+	struct pager_share *share = pager_share_find(physical, &link);
+
+	if (share == NULL) {
+		return true;
 	}
 
-	memset(tables, 0, PAGE_SIZE);
+	if (--share->count <= 1) {
+		// A single mapping is left, it owns the page from here on
+		*link = share->next;
+		free(share);
+	}
 
-	return (void *)((uintptr_t)tables | pcid);
+	return false;
 }
 
-static int pager_map_callback(struct pager_traverse_info *info, uint64_t *table, int index, int level) {
-	if (info == NULL || table == NULL || level == 0) {
-		return -1;
-	}
+static int pager_share_get(uintptr_t physical) {
+	spinlock_lock(&pager_share_lock);
+	int ret = pager_share_get_locked(physical);
+	spinlock_unlock(&pager_share_lock);
 
-        bool A = ((table[index] >> 5) & 1) && info->dest_table == info->cur_table;
-        
-	table[index] = info->physical | get_entry_bits(level, info->attributes);
+	return ret;
+}
 
-	if (A) {
-		__asm__("invlpg %0" : : "m"(info->virtual) : );
-	}
+static bool pager_share_put(uintptr_t physical) {
+	spinlock_lock(&pager_share_lock);
+	bool last = pager_share_put_locked(physical);
+	spinlock_unlock(&pager_share_lock);
 
-	return 0;
+	return last;
 }
 
-int pager_map(void *page_tables, uintptr_t virtual, uintptr_t physical, size_t size, uint32_t attributes) {
+int pager_set_shared_entry(bool enable) {
+	if (enable && !pager_share_kernel) {
+		ARC_DEBUG(ERR, "Kernel half is not shared, entries have to switch page tables\n");
+		return -1;
+	}
+
+	tlb_set_shared_entry(enable);
+
+	return 0;
+}
+
+/**
+ * Start a batch of invalidations for changes to the given page tables.
+ *
+ * Changes to the kernel's half of page tables that share it concern every
+ * address space.
+ *
+ * @param ARC_TLBBatch *batch - The batch to start.
+ * @param void *dest_table - The page tables being changed.
+ * @param void *cur_table - The currently loaded page tables.
+ * @param uintptr_t virtual - The first address being changed.
+ * */
+static void pager_batch_init(ARC_TLBBatch *batch, void *dest_table, void *cur_table, uintptr_t virtual) {
+	if (virtual >= KERNEL_HALF && pager_shares_kernel_half(dest_table)) {
+		tlb_batch_init(batch, ARC_TLB_ALL_ADDRESS_SPACES, true);
+		return;
+	}
+
+	tlb_batch_init(batch, ARC_TLB_ADDRESS_SPACE(dest_table), dest_table == cur_table);
+}
+
+/**
+ * Check whether a table is entirely zero.
+ *
+ * A not present entry may still hold software bits or an address, such a
+ * table is kept, as released tables go back into the zero cache.
+ *
+ * @param uint64_t *table - The table to check.
+ * @return true if the table is empty.
+ * */
+static bool pager_table_empty(uint64_t *table) {
+	uint64_t bits = 0;
+
+	for (int i = 0; i < 512; i++) {
+		bits |= table[i];
+	}
+
+	return bits == 0;
+}
+
+/**
+ * Remove a table that has become empty from its parent.
+ *
+ * The table is put on the given list to be freed once its removal has been
+ * flushed. The list is linked through the first entry of each table, which
+ * stays not present as the tables are page aligned. A table shared with other
+ * page tables only loses a reference, it is freed by the last of them.
+ *
+ * @param struct pager_traverse_info *info - The current traversal.
+ * @param uint64_t *parent - The parent table.
+ * @param int index - The index of the table in the parent.
+ * @param int level - The level of the parent.
+ * @param uintptr_t virtual - An address the table translates.
+ * @param uint64_t **freed - The list to put the table on.
+ * */
+static void pager_release_table(struct pager_traverse_info *info, uint64_t *parent, int index, int level, uintptr_t virtual, uint64_t **freed) {
+	uint64_t entry = parent[index];
+	uint64_t *table = (uint64_t *)ARC_PHYS_TO_HHDM(entry & ADDRESS_MASK);
+	int shift = ((level - 1) * 9) + 12;
+
+	parent[index] = 0;
+	tlb_batch_add(&info->batch, ALIGN_DOWN(virtual, 1ULL << shift), shift);
+
+	if ((entry & ENTRY_SHARED_TABLE) != 0 && !pager_share_put(entry & ADDRESS_MASK)) {
+		// Still used by other page tables
+		return;
+	}
+
+	table[0] = (uint64_t)*freed;
+	*freed = table;
+}
+
+/**
+ * Give page tables their own copy of a table they share with others.
+ *
+ * The tables below the copy become shared by it and the original, so only
+ * the table on the way to a change is copied. If the other page tables have
+ * already let go of the table, it is kept and just marked as not shared.
+ *
+ * NOTE: Accessed and dirty bits the processor sets in the original while it
+ *       is copied are not seen in the copy.
+ *
+ * @param struct pager_traverse_info *info - The current traversal.
+ * @param uint64_t *parent - The table holding the entry of the shared table.
+ * @param int index - The index of the entry in the parent.
+ * @param int level - The level of the parent.
+ * @return zero on success, or if another walk unshared the table first.
+ * */
+static int pager_unshare(struct pager_traverse_info *info, uint64_t *parent, int index, int level) {
+	uint64_t *copy = (uint64_t *)pager_page_alloc();
+
+	if (copy == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate table to unshare\n");
+		return -1;
+	}
+
+	int ret = 0;
+
+	spinlock_lock(&pager_share_lock);
+
+	uint64_t entry = __atomic_load_n(&parent[index], __ATOMIC_ACQUIRE);
+	uint64_t physical = entry & ADDRESS_MASK;
+	struct pager_share **link = NULL;
+
+	if ((entry & ENTRY_SHARED_TABLE) == 0) {
+		goto done;
+	}
+
+	if (pager_share_find(physical, &link) == NULL) {
+		// Last one left using the table
+		__atomic_fetch_and(&parent[index], ~ENTRY_SHARED_TABLE, __ATOMIC_ACQ_REL);
+		goto done;
+	}
+
+	uint64_t *table = (uint64_t *)ARC_PHYS_TO_HHDM(physical);
+	memcpy(copy, table, PAGE_SIZE);
+
+	// The tables below are shared by the copy as well, pages are not
+	for (int i = 0; level > 2 && i < 512; i++) {
+		if ((copy[i] & 1) == 0 || ((copy[i] >> 7) & 1) == 1) {
+			continue;
+		}
+
+		if (pager_share_get_locked(copy[i] & ADDRESS_MASK) != 0) {
+			for (int j = 0; j < i; j++) {
+				if ((copy[j] & 1) == 1 && ((copy[j] >> 7) & 1) == 0) {
+					pager_share_put_locked(copy[j] & ADDRESS_MASK);
+				}
+			}
+
+			ret = -1;
+			goto done;
+		}
+
+		copy[i] |= ENTRY_SHARED_TABLE;
+		__atomic_fetch_or(&table[i], ENTRY_SHARED_TABLE, __ATOMIC_ACQ_REL);
+	}
+
+	uint64_t new = 0;
+
+	do {
+		// Only the processor setting the accessed bit can change the
+		// entry while the lock is held
+		new = (uint64_t)ARC_HHDM_TO_PHYS(copy) | (entry & ~ADDRESS_MASK & ~ENTRY_SHARED_TABLE);
+	} while (!__atomic_compare_exchange_n(&parent[index], &entry, new, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	pager_share_put_locked(physical);
+	copy = NULL;
+	ARC_PAGER_COUNT(tables_allocated, 1);
+	ARC_PAGER_COUNT(unshares, 1);
+
+	// Walks of the shared table may still be cached
+	int shift = ((level - 1) * 9) + 12;
+	tlb_batch_add(&info->batch, ALIGN_DOWN(info->virtual, 1ULL << shift), shift);
+
+	done:;
+
+	spinlock_unlock(&pager_share_lock);
+
+	if (copy != NULL) {
+		pmm_fast_page_free(copy);
+	}
+
+	return ret;
+}
+
+/**
+ * Release the tables in a region that no longer map anything.
+ *
+ * Tables are released bottom up, so a directory left empty by the release
+ * of its tables goes too. PML3 tables of the higher half are never released,
+ * as they may be shared with other page tables. Tables below a table shared by
+ * pager_clone are left alone, only the shared table itself may be released.
+ * Tables that are being walked are left for a later prune.
+ *
+ * @param struct pager_traverse_info *info - The current traversal.
+ * @param uintptr_t virtual - The start of the region.
+ * @param size_t size - The size of the region in bytes.
+ * @param uint64_t **freed - The list to put the released tables on.
+ * */
+static void pager_prune(struct pager_traverse_info *info, uintptr_t virtual, size_t size, uint64_t **freed) {
+	uint64_t *pml4 = (uint64_t *)ALIGN_DOWN(info->dest_table, PAGE_SIZE);
+	uintptr_t base = ALIGN_DOWN(virtual, TWO_MIB);
+	size += virtual - base;
+
+	while (size) {
+		int pml4e = (base >> 39) & 0x1FF;
+		int pml3e = (base >> 30) & 0x1FF;
+		int pml2e = (base >> 21) & 0x1FF;
+		uint64_t skip = TWO_MIB;
+
+		uint64_t entry = __atomic_load_n(&pml4[pml4e], __ATOMIC_ACQUIRE);
+
+		if ((entry & 1) == 0) {
+			skip = (1ULL << 39) - (base & ((1ULL << 39) - 1));
+			goto next;
+		}
+
+		bool I = arch_interrupts_enabled();
+		ARC_DISABLE_INTERRUPT;
+
+		struct pager_slot *slot = pager_slot(entry);
+
+		if (!pager_slot_try_lock(slot)) {
+			if (I) {
+				ARC_ENABLE_INTERRUPT;
+			}
+
+			goto next;
+		}
+
+		if (pml4[pml4e] != entry) {
+			// Released before the lock was taken
+			skip = (1ULL << 39) - (base & ((1ULL << 39) - 1));
+			goto unlock;
+		}
+
+		uint64_t *pml3 = (uint64_t *)ARC_PHYS_TO_HHDM(entry & ADDRESS_MASK);
+
+		if ((entry & ENTRY_SHARED_TABLE) != 0) {
+			skip = (1ULL << 39) - (base & ((1ULL << 39) - 1));
+		} else if ((pml3[pml3e] & 1) == 1 && ((pml3[pml3e] >> 7) & 1) == 0) {
+			uint64_t *pml2 = (uint64_t *)ARC_PHYS_TO_HHDM(pml3[pml3e] & ADDRESS_MASK);
+			bool shared = (pml3[pml3e] & ENTRY_SHARED_TABLE) != 0;
+
+			if (shared) {
+				skip = ONE_GIB - (base & (ONE_GIB - 1));
+			} else if ((pml2[pml2e] & 1) == 1 && ((pml2[pml2e] >> 7) & 1) == 0
+				   && pager_table_empty((uint64_t *)ARC_PHYS_TO_HHDM(pml2[pml2e] & ADDRESS_MASK))) {
+				pager_release_table(info, pml2, pml2e, 2, base, freed);
+			}
+
+			// Leaving the directory, see if it can go too
+			if ((shared || pml2e == 511 || size <= TWO_MIB) && pager_table_empty(pml2)) {
+				pager_release_table(info, pml3, pml3e, 3, base, freed);
+			}
+		} else {
+			skip = ONE_GIB - (base & (ONE_GIB - 1));
+		}
+
+		// Leaving the PML3 table, see if it can go too
+		if ((((base + skip) & ((1ULL << 39) - 1)) == 0 || size <= skip) && pml4e < 256 && pager_table_empty(pml3)) {
+			pager_release_table(info, pml4, pml4e, 4, base, freed);
+			skip = (1ULL << 39) - (base & ((1ULL << 39) - 1));
+		}
+
+		unlock:;
+
+		pager_slot_unlock(slot);
+
+		if (I) {
+			ARC_ENABLE_INTERRUPT;
+		}
+
+		next:;
+
+		if (skip >= size) {
+			break;
+		}
+
+		base += skip;
+		size -= skip;
+	}
+}
+
+/**
+ * Move a traversal past the part of its range that was just handled.
+ *
+ * With segments, the physical address moves on to the next segment once
+ * the current one is used up.
+ *
+ * @param struct pager_traverse_info *info - The traversal.
+ * @param size_t step - The bytes handled.
+ * */
+static void pager_advance(struct pager_traverse_info *info, size_t step) {
+	info->virtual += step;
+	info->size -= step;
+
+	if (info->segments == NULL) {
+		info->physical += step;
+		return;
+	}
+
+	while (info->segment_count > 0 && step >= info->segment_left) {
+		step -= info->segment_left;
+		info->segments++;
+		info->segment_count--;
+		info->physical = info->segment_count > 0 ? info->segments->physical : 0;
+		info->segment_left = info->segment_count > 0 ? info->segments->size : 0;
+	}
+
+	info->physical += step;
+	info->segment_left -= step;
+}
+
+/**
+ * Standard function to traverse x86-64 page tables
+ *
+ * A huge page is only used where the virtual address (and, unless
+ * info->any_physical, the physical address) is aligned to its size and the
+ * rest of the range covers it. An unaligned range is therefore walked as a
+ * run of 4 KiB pages up to the first boundary, huge pages in the middle, and
+ * 4 KiB pages after the last boundary.
+ *
+ * The tables the last step went through are remembered, and only the levels
+ * whose part of the virtual address changed are walked again. Consecutive
+ * 4 KiB pages in the same page table therefore only touch the leaf entry.
+ *
+ * Entries are installed and replaced atomically, so walks of the same
+ * tables can run at once. The tables below the PML4 entry being walked are
+ * kept from being freed by counting the walk into its slot.
+ *
+ * @param struct pager_traverse_info *info - Information to use for traversing and to pass to the callback.
+ * @param int *(callback)(...) - The callback function.
+ * @return zero on success.
+ * */
+static int pager_traverse(struct pager_traverse_info *info, int (*callback)(struct pager_traverse_info *info, uint64_t *table, int index, int level)) {
+	if (info == NULL || info->dest_table == NULL) {
+		return -1;
+	}
+
+	info->size = ALIGN_UP(info->size, PAGE_SIZE);
+	uintptr_t start = info->virtual;
+
+	if (pager_global && info->virtual >= KERNEL_HALF
+	    && (ALIGN_DOWN(info->dest_table, PAGE_SIZE) == ALIGN_DOWN(ARC_PHYS_TO_HHDM(Arc_KernelPageTables), PAGE_SIZE)
+		|| pager_shares_kernel_half(info->dest_table))) {
+		// The kernel's pages are the same in every address space, keep
+		// them cached across switches
+		MASKED_WRITE(info->attributes, 1, ARC_PAGER_GLOBAL, 1);
+	}
+
+	size_t total = info->size;
+	pager_batch_init(&info->batch, info->dest_table, info->cur_table, info->virtual);
+
+	// Walk cache, tables[n] is the table of level n last walked through and
+	// tags[n] is the part of the virtual address it translates
+	uint64_t *tables[5] = { 0 };
+	uintptr_t tags[5] = { 0 };
+	uint32_t *indices[5] = { NULL, &info->pml1e, &info->pml2e, &info->pml3e, &info->pml4e };
+	struct pager_slot *slot = NULL;
+
+	tables[4] = (uint64_t *)ALIGN_DOWN(info->dest_table, PAGE_SIZE); // PML4
+									 // Align down is used to cut out
+									 // the PCID
+
+	int ret = 0;
+
+	while (info->size) {
+		// A page can only map physically contiguous memory
+		size_t contiguous = info->segments != NULL && info->segment_left < info->size ? info->segment_left : info->size;
+		uintptr_t alignment = info->virtual | (info->any_physical ? 0 : info->physical);
+		bool can_gib = ARC_CHECK_FEATURE(paging, ARC_PAGER_FLAG_GIB)
+   			       && !MASKED_READ(info->attributes, ARC_PAGER_4K, 1)
+			       && (contiguous >= ONE_GIB)
+			       && (alignment & (ONE_GIB - 1)) == 0;
+		bool can_2mib = (contiguous >= TWO_MIB)
+				&& !MASKED_READ(info->attributes, ARC_PAGER_4K, 1)
+				&& (alignment & (TWO_MIB - 1)) == 0;
+
+		MASKED_WRITE(info->attributes, can_gib, ARC_PAGER_RESV0, 1);
+		MASKED_WRITE(info->attributes, can_2mib, ARC_PAGER_RESV1, 1);
+
+		int leaf = can_gib ? 3 : (can_2mib ? 2 : 1);
+
+		// Find the lowest cached table that still applies
+		int level = leaf;
+		while (level < 4 && (tables[level] == NULL || tags[level] != info->virtual >> ((level * 9) + 12))) {
+			level++;
+		}
+
+		// Walk down from it to the table holding the leaf entry, going
+		// further down where a table takes the place of a huge page
+		int index = 0;
+		uint64_t skip = 0;
+
+		for (;; level--) {
+			if (info->no_split && level > 1 && level < 4) {
+				index = (info->virtual >> (((level - 1) * 9) + 12)) & 0x1FF;
+				uint64_t entry = __atomic_load_n(&tables[level][index], __ATOMIC_ACQUIRE);
+
+				if ((entry & 1) == 1 && ((entry >> 7) & 1) == 1) {
+					// Huge page to be handled whole
+					*indices[level] = index;
+					break;
+				}
+			}
+
+			index = get_page_table(tables[level], level, info->virtual, info->attributes);
+
+			if (index == -1) {
+				ret = -2;
+				goto done;
+			}
+
+			*indices[level] = index;
+
+			uint64_t entry = __atomic_load_n(&tables[level][index], __ATOMIC_ACQUIRE);
+			bool is_table = level > 1 && (entry & 1) == 1 && ((entry >> 7) & 1) == 0;
+
+			if (level <= leaf && !is_table) {
+				break;
+			}
+
+			if ((entry & 1) == 0) {
+				// Hole that was not allowed to be filled, skip it
+				uint64_t span = 1ULL << (((level - 1) * 9) + 12);
+				skip = span - (info->virtual & (span - 1));
+				break;
+			}
+
+			if (level == 4 && pager_slot(entry) != slot) {
+				// Keep the tables below from being freed while
+				// they are walked
+				if (slot != NULL) {
+					pager_slot_leave(slot, true);
+				}
+
+				slot = pager_slot(entry);
+				pager_slot_enter(slot);
+
+				if (__atomic_load_n(&tables[4][index], __ATOMIC_ACQUIRE) != entry) {
+					// Released before the walk got in, look again
+					level++;
+					continue;
+				}
+			}
+
+			if ((entry & ENTRY_SHARED_TABLE) != 0 && !info->keep_shared) {
+				// The walk may change what is below, the table has to
+				// belong to these page tables alone first
+				if (pager_unshare(info, tables[level], index, level) != 0) {
+					ret = -2;
+					goto done;
+				}
+
+				level++;
+				continue;
+			}
+
+			tables[level - 1] = (uint64_t *)ARC_PHYS_TO_HHDM(entry & ADDRESS_MASK);
+			tags[level - 1] = info->virtual >> (((level - 1) * 9) + 12);
+		}
+
+		if (skip != 0) {
+			if (skip >= info->size) {
+				break;
+			}
+
+			pager_advance(info, skip);
+
+			continue;
+		}
+
+		leaf = level;
+		size_t step = (size_t)1 << (((leaf - 1) * 9) + 12);
+		uint32_t bulk = 1;
+
+		if ((info->virtual & (step - 1)) != 0 || contiguous < step) {
+			// Only part of a huge page that was not split is in the
+			// range
+			step -= info->virtual & (step - 1);
+			step = step < contiguous ? step : contiguous;
+		} else {
+			// Let the callback handle the rest of the table in one go,
+			// up to the next entry that points to a table
+			size_t left = contiguous / step;
+			bulk = left < (size_t)(512 - index) ? left : (size_t)(512 - index);
+
+			for (uint32_t i = 1; leaf > 1 && i < bulk; i++) {
+				uint64_t entry = tables[leaf][index + i];
+
+				if ((entry & 1) == 1 && ((entry >> 7) & 1) == 0) {
+					bulk = i;
+				}
+			}
+		}
+
+		info->bulk_max = bulk;
+		info->bulk_done = 1;
+
+		if (callback(info, tables[leaf], index, leaf) != 0) {
+			ret = -3;
+			goto done;
+		}
+
+		// The callback may have replaced a table below the leaf
+		for (int i = 1; i < leaf; i++) {
+			tables[i] = NULL;
+		}
+
+		step *= info->bulk_done;
+		pager_advance(info, step);
+	}
+
+	done:;
+
+	if (slot != NULL) {
+		pager_slot_leave(slot, true);
+	}
+
+	uint64_t *freed = NULL;
+
+	if (info->prune) {
+		pager_prune(info, start, total, &freed);
+	}
+
+	// Flush whatever was modified, even if the traversal failed part way,
+	// on this processor and any other that has the tables loaded
+	tlb_batch_flush(&info->batch);
+
+	// No processor can reach the released tables anymore
+	while (freed != NULL) {
+		uint64_t *next = (uint64_t *)freed[0];
+		freed[0] = 0;
+		pager_free_zeroed(freed);
+		freed = next;
+		ARC_PAGER_COUNT(tables_freed, 1);
+	}
+
+	return ret;
+}
+
+void *pager_create_page_tables() {
+	int pcid = 0;
+
+	if (ARC_CHECK_FEATURE(paging, ARC_PAGER_FLAG_PCID)) {
+		pcid = pcid_allocate();
+
+		if (pcid < 0) {
+			ARC_DEBUG(ERR, "Failed to allocate PCID\n");
+			return NULL;
+		}
+	}
+
+	uint64_t *tables = pager_alloc_zeroed();
+
+	if (tables == NULL) {
+		if (pcid != 0) {
+			pcid_free(pcid);
+		}
+
+		return NULL;
+	}
+
+	if (pager_prepare_kernel_half()) {
+		// The kernel's half is shared by reference, it never has to be
+		// mapped into the new tables
+		uint64_t *kernel = (uint64_t *)ALIGN_DOWN(ARC_PHYS_TO_HHDM(Arc_KernelPageTables), PAGE_SIZE);
+		memcpy(&tables[256], &kernel[256], 256 * sizeof(*tables));
+	}
+
+	return (void *)((uintptr_t)tables | pcid);
+}
+
+static int pager_map_callback(struct pager_traverse_info *info, uint64_t *table, int index, int level) {
+	if (info == NULL || table == NULL || level == 0) {
+		return -1;
+	}
+
+	pager_fill_entries(info, table, index, level, info->bulk_max);
+	info->bulk_done = info->bulk_max;
+
+	return 0;
+}
+
+int pager_map(void *page_tables, uintptr_t virtual, uintptr_t physical, size_t size, uint32_t attributes) {
 	void *pml4 = (void *)ARC_PHYS_TO_HHDM(_x86_getCR3());
 	struct pager_traverse_info info = { .virtual = virtual, .physical = physical,
 	                                    .size = size, .attributes = attributes,
 					    .dest_table = page_tables == NULL ? pml4 : page_tables,
 					    .cur_table = pml4 };
 
-	if (pager_traverse(&info, pager_map_callback) != 0) {
-		ARC_DEBUG(ERR, "Failed to map P0x%"PRIx64":V0x%"PRIx64" (0x%"PRIx64" B, 0x%x)\n", physical, virtual, size, attributes);
-		return -1;
+	if (pager_traverse(&info, pager_map_callback) != 0) {
+		ARC_DEBUG(ERR, "Failed to map P0x%"PRIx64":V0x%"PRIx64" (0x%"PRIx64" B, 0x%x)\n", physical, virtual, size, attributes);
+		return -1;
+	}
+
+	return 0;
+}
+
+int pager_map_sg(void *page_tables, uintptr_t virtual, const ARC_PagerSegment *segments, size_t count, uint32_t attributes) {
+	if (segments == NULL) {
+		ARC_DEBUG(ERR, "No segments given\n");
+		return -1;
+	}
+
+	size_t size = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		if (((segments[i].physical | segments[i].size) & (PAGE_SIZE - 1)) != 0) {
+			ARC_DEBUG(ERR, "Segment %lu (P0x%"PRIx64", 0x%"PRIx64" B) is not page aligned\n", i, segments[i].physical, segments[i].size);
+			return -1;
+		}
+
+		size += segments[i].size;
+	}
+
+	if (size == 0) {
+		return 0;
+	}
+
+	void *pml4 = (void *)ARC_PHYS_TO_HHDM(_x86_getCR3());
+	struct pager_traverse_info info = { .virtual = virtual, .physical = segments[0].physical,
+	                                    .size = size, .attributes = attributes,
+					    .dest_table = page_tables == NULL ? pml4 : page_tables,
+					    .cur_table = pml4, .segments = segments, .segment_count = count,
+					    .segment_left = segments[0].size };
+
+	// Past any empty segments at the start
+	pager_advance(&info, 0);
+
+	if (pager_traverse(&info, pager_map_callback) != 0) {
+		ARC_DEBUG(ERR, "Failed to map %lu segments to V0x%"PRIx64" (0x%"PRIx64" B, 0x%x)\n", count, virtual, size, attributes);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int pager_unmap_callback(struct pager_traverse_info *info, uint64_t *table, int index, int level) {
+	if (info == NULL || table == NULL || level == 0) {
+		return -1;
+	}
+
+	if ((table[index] & 1) == 0) {
+		return 0;
+	}
+
+	uint64_t old = pager_set_entry(&table[index], 0);
+	uint64_t physical = old & ADDRESS_MASK;
+	bool owned = (old & 1) == 1;
+
+	if (owned && (old & (ENTRY_COW | ENTRY_SHARED)) != 0) {
+		// The frame only goes to the caller along with its last mapping
+		owned = physical != pager_zero_page && pager_share_put(physical);
+	}
+
+	if (info->physical == 0 && owned) {
+		info->physical = physical;
+	}
+
+	if ((old >> 5) & 1) {
+		pager_invalidate(info, level);
+	}
+
+	return 0;
+}
+
+int pager_unmap(void *page_tables, uintptr_t virtual, size_t size, void **physical) {
+	void *pml4 = (void *)ARC_PHYS_TO_HHDM(_x86_getCR3());
+	struct pager_traverse_info info = { .virtual = virtual, .physical = 0, .size = size, .attributes = 1 << ARC_PAGER_RESV2,
+					    .dest_table = page_tables == NULL ? pml4 : page_tables, .cur_table = pml4, .any_physical = true,
+					    .prune = true };
+
+	if (pager_traverse(&info, pager_unmap_callback) != 0) {
+		ARC_DEBUG(ERR, "Failed to map V0x%"PRIx64" (0x%"PRIx64" B)\n", virtual, size);
+		return -1;
+	}
+
+	if (physical != NULL) {
+		*physical = (void *)info.physical;
+	}
+
+	return 0;
+}
+
+static int pager_fly_map_callback(struct pager_traverse_info *info, uint64_t *table, int index, int level) {
+	if (info == NULL || table == NULL || level == 0) {
+		ARC_DEBUG(ERR, "Invalid parameters\n");
+		return -1;
+	}
+
+	void *page = pager_alloc_zeroed();
+
+	if (page == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate a page\n");
+		return -2;
+	}
+
+	uint64_t old = pager_set_entry(&table[index], ARC_HHDM_TO_PHYS(page) | get_entry_bits(level, info->attributes));
+
+	if ((old >> 5) & 1) {
+		pager_invalidate(info, level);
+	}
+
+	return 0;
+}
+
+int pager_fly_map(void *page_tables, uintptr_t virtual, size_t size, uint32_t attributes) {
+	attributes |= 1 << ARC_PAGER_4K;
+
+	void *pml4 = (void *)ARC_PHYS_TO_HHDM(_x86_getCR3());
+	struct pager_traverse_info info = { .virtual = virtual, .size = size, .attributes = attributes, 
+					    .dest_table = page_tables == NULL ? pml4 : page_tables, .cur_table = pml4, .any_physical = true };
+
+	if (pager_traverse(&info, pager_fly_map_callback) != 0) {
+		ARC_DEBUG(ERR, "Failed to fly map 0x%"PRIx64" (0x%"PRIx64" B, 0x%x)\n", virtual, size, attributes);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int pager_fly_map_lazy_callback(struct pager_traverse_info *info, uint64_t *table, int index, int level) {
+	if (info == NULL || table == NULL || level == 0) {
+		ARC_DEBUG(ERR, "Invalid parameters\n");
+		return -1;
+	}
+
+	// Writable pages are copy-on-write of the zero page
+	uint64_t entry = pager_zero_page | get_entry_bits(level, info->attributes & ~(1 << ARC_PAGER_RW));
+
+	if (MASKED_READ(info->attributes, ARC_PAGER_RW, 1)) {
+		entry |= ENTRY_COW;
+	}
+
+	uint64_t old = 0;
+
+	for (uint32_t i = 0; i < info->bulk_max; i++) {
+		old |= pager_set_entry(&table[index + i], entry);
+	}
+
+	if ((old >> 5) & 1) {
+		for (uint32_t i = 0; i < info->bulk_max; i++) {
+			tlb_batch_add(&info->batch, info->virtual + (i * PAGE_SIZE), 12);
+		}
+	}
+
+	info->bulk_done = info->bulk_max;
+
+	return 0;
+}
+
+int pager_fly_map_lazy(void *page_tables, uintptr_t virtual, size_t size, uint32_t attributes) {
+	attributes |= 1 << ARC_PAGER_4K;
+
+	void *pml4 = (void *)ARC_PHYS_TO_HHDM(_x86_getCR3());
+	struct pager_traverse_info info = { .virtual = virtual, .size = size, .attributes = attributes,
+					    .dest_table = page_tables == NULL ? pml4 : page_tables, .cur_table = pml4, .any_physical = true };
+
+	if (pager_traverse(&info, pager_fly_map_lazy_callback) != 0) {
+		ARC_DEBUG(ERR, "Failed to lazily fly map 0x%"PRIx64" (0x%"PRIx64" B, 0x%x)\n", virtual, size, attributes);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int pager_fly_unmap_callback(struct pager_traverse_info *info, uint64_t *table, int index, int level) {
+	if (info == NULL || table == NULL || level == 0) {
+		return -1;
+	}
+
+	if ((table[index] & 1) == 0) {
+		return 0;
+	}
+
+	uint64_t old = pager_set_entry(&table[index], 0);
+	uint64_t physical = old & ADDRESS_MASK;
+
+	// Shared pages are only freed along with their last mapping
+	if ((old & 1) == 0 || physical == pager_zero_page) {
+		// Lost to another unmap, or never written to
+	} else if ((old & (ENTRY_COW | ENTRY_SHARED)) == 0 || pager_share_put(physical)) {
+		pmm_fast_page_free((void *)ARC_PHYS_TO_HHDM(physical));
+	}
+
+	if ((old >> 5) & 1) {
+		pager_invalidate(info, level);
+	}
+
+	return 0;
+}
+
+int pager_fly_unmap(void *page_tables, uintptr_t virtual, size_t size) {
+	void *pml4 = (void *)ARC_PHYS_TO_HHDM(_x86_getCR3());
+
+	// Every page was allocated on its own, so they are freed one by one
+	// even if the pages have been collapsed into a huge page since
+	struct pager_traverse_info info = { .virtual = virtual, .size = size, .attributes = (1 << ARC_PAGER_4K) | (1 << ARC_PAGER_RESV2),
+					     .dest_table = page_tables == NULL ? pml4 : page_tables, .cur_table = pml4, .any_physical = true,
+					     .prune = true };
+
+	if (pager_traverse(&info, pager_fly_unmap_callback) != 0) {
+		ARC_DEBUG(ERR, "Failed to map V0x%"PRIx64" (0x%"PRIx64" B)\n", virtual, size);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int pager_set_attr_callback(struct pager_traverse_info *info, uint64_t *table, int index, int level) {
+	if (info == NULL || table == NULL || level == 0) {
+		return -1;
+	}
+        
+	uint64_t old = __atomic_load_n(&table[index], __ATOMIC_RELAXED);
+	uint64_t new = 0;
+
+	// Retry until no accessed or dirty bit is set in between
+	// Bit 12 is the PAT bit of huge pages, not part of the address
+	uint64_t address = old & ADDRESS_MASK & (level > 1 ? ~(1ULL << 12) : ~0ULL);
+
+	do {
+		// The pager's own bits stay, a page shared with other mappings
+		// stays read only until it is copied on a fault
+		uint64_t software = old & (0b111ULL << 9);
+		new = address | software | get_entry_bits(level, info->attributes);
+
+		if ((software & (ENTRY_COW | ENTRY_SHARED)) != 0) {
+			new &= ~(1ULL << 1);
+		}
+	} while (!__atomic_compare_exchange_n(&table[index], &old, new, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	if ((old >> 5) & 1) {
+		pager_invalidate(info, level);
+	}
+
+	return 0;
+}
+
+int pager_set_attr(void *page_tables, uintptr_t virtual, size_t size, uint32_t attributes) {
+	void *pml4 = (void *)ARC_PHYS_TO_HHDM(_x86_getCR3());
+	struct pager_traverse_info info = { .virtual = virtual, .size = size, .attributes = attributes, 
+					    .dest_table = page_tables == NULL ? pml4 : page_tables, .cur_table = pml4, .any_physical = true };
+
+	if (pager_traverse(&info, pager_set_attr_callback) != 0) {
+		ARC_DEBUG(ERR, "Failed to set attr V0x%"PRIx64" (0x%"PRIx64" B, 0x%x)\n", virtual, size, attributes);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int pager_memory_type_callback(struct pager_traverse_info *info, uint64_t *table, int index, int level) {
+	if (info == NULL || table == NULL || level == 0) {
+		return -1;
+	}
+
+	uint32_t type = MASKED_READ(info->attributes, ARC_PAGER_PAT, 0b111);
+	uint64_t pat = level == 1 ? 1ULL << 7 : 1ULL << 12;
+	uint64_t mask = (1ULL << 3) | (1ULL << 4) | pat;
+	uint64_t bits = ((uint64_t)(type & 1) << 3) | ((uint64_t)((type >> 1) & 1) << 4) | ((type >> 2) & 1 ? pat : 0);
+
+	uint64_t old = __atomic_load_n(&table[index], __ATOMIC_RELAXED);
+	uint64_t new = 0;
+
+	// Retry until no accessed or dirty bit is set in between
+	do {
+		if ((old & 1) == 0) {
+			return 0;
+		}
+
+		new = (old & ~mask) | bits;
+	} while (!__atomic_compare_exchange_n(&table[index], &old, new, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	if ((old >> 5) & 1) {
+		pager_invalidate(info, level);
+	}
+
+	return 0;
+}
+
+int pager_set_memory_type(void *page_tables, uintptr_t virtual, size_t size, uint32_t type) {
+	void *pml4 = (void *)ARC_PHYS_TO_HHDM(_x86_getCR3());
+	void *dest_table = page_tables == NULL ? pml4 : page_tables;
+	struct pager_traverse_info info = { .virtual = virtual, .size = size,
+					    .attributes = (1 << ARC_PAGER_RESV2) | (type & (0b111 << ARC_PAGER_PAT)),
+					    .dest_table = dest_table, .cur_table = pml4, .any_physical = true };
+
+	if (pager_traverse(&info, pager_memory_type_callback) != 0) {
+		ARC_DEBUG(ERR, "Failed to set memory type V0x%"PRIx64" (0x%"PRIx64" B, %d)\n", virtual, size, type >> ARC_PAGER_PAT);
+		return -1;
+	}
+
+	// The pages may still be in the caches from before, which the new type
+	// may not look in
+	bool reachable = ALIGN_DOWN(dest_table, PAGE_SIZE) == ALIGN_DOWN(pml4, PAGE_SIZE)
+			 || (virtual >= KERNEL_HALF && pager_shares_kernel_half(dest_table));
+
+	if (!reachable) {
+		__asm__("wbinvd" ::: "memory");
+		return 0;
+	}
+
+	uintptr_t end = virtual + size;
+
+	for (uintptr_t page = ALIGN_DOWN(virtual, PAGE_SIZE); page < end; page += PAGE_SIZE) {
+		ARC_PagerTranslation translation;
+
+		if (pager_query(NULL, &page, &translation, 1) != 0) {
+			continue;
+		}
+
+		for (uintptr_t line = page; line < page + PAGE_SIZE; line += 64) {
+			__asm__("clflush [%0]" :: "r"(line) : "memory");
+		}
+	}
+
+	__asm__("mfence" ::: "memory");
+
+	return 0;
+}
+
+/**
+ * Set a run of bits in a bitmap.
+ *
+ * @param uint64_t *bitmap - The bitmap.
+ * @param size_t first - The first bit to set.
+ * @param size_t count - The number of bits to set.
+ * */
+static void pager_bitmap_set(uint64_t *bitmap, size_t first, size_t count) {
+	while (count > 0) {
+		size_t bit = first & 63;
+		size_t run = 64 - bit < count ? 64 - bit : count;
+		uint64_t mask = run == 64 ? UINT64_MAX : ((1ULL << run) - 1) << bit;
+
+		bitmap[first >> 6] |= mask;
+		first += run;
+		count -= run;
+	}
+}
+
+static int pager_harvest_callback(struct pager_traverse_info *info, uint64_t *table, int index, int level) {
+	if (info == NULL || table == NULL || level == 0) {
+		return -1;
+	}
+
+	int shift = ((level - 1) * 9) + 12;
+	size_t span = (size_t)1 << shift;
+
+	// NOTE: info->physical is the offset into the range, the first entry
+	//       may be a huge page only partly in it
+	size_t first = span - (info->virtual & (span - 1));
+	first = first < info->size ? first : info->size;
+
+	for (uint32_t i = 0; i < info->bulk_max; i++) {
+		uint64_t entry = __atomic_load_n(&table[index + i], __ATOMIC_RELAXED);
+		size_t offset = info->physical + (i == 0 ? 0 : first + ((i - 1) * span));
+		size_t pages = (i == 0 ? first : span) >> PAGE_SIZE_LOWEST_EXPONENT;
+
+		if ((entry & 1) == 0 || (entry & ENTRY_ACCESSED_DIRTY) == 0) {
+			continue;
+		}
+
+		if (info->clear) {
+			entry = __atomic_fetch_and(&table[index + i], ~ENTRY_ACCESSED_DIRTY, __ATOMIC_ACQ_REL);
+			// The processor only sets the bits again once the entry
+			// is no longer cached
+			tlb_batch_add(&info->batch, ALIGN_DOWN(info->virtual, span) + (i * span), shift);
+		}
+
+		if (info->accessed != NULL && ((entry >> 5) & 1)) {
+			pager_bitmap_set(info->accessed, offset >> PAGE_SIZE_LOWEST_EXPONENT, pages);
+		}
+
+		if (info->dirty != NULL && ((entry >> 6) & 1)) {
+			pager_bitmap_set(info->dirty, offset >> PAGE_SIZE_LOWEST_EXPONENT, pages);
+		}
+	}
+
+	info->bulk_done = info->bulk_max;
+
+	return 0;
+}
+
+int pager_harvest(void *page_tables, uintptr_t virtual, size_t size, uint64_t *accessed, uint64_t *dirty, bool clear) {
+	void *pml4 = (void *)ARC_PHYS_TO_HHDM(_x86_getCR3());
+
+	virtual = ALIGN_DOWN(virtual, PAGE_SIZE);
+	size = ALIGN_UP(size, PAGE_SIZE);
+	size_t words = ALIGN_UP(size >> PAGE_SIZE_LOWEST_EXPONENT, 64) / 64;
+
+	if (accessed != NULL) {
+		memset(accessed, 0, words * sizeof(uint64_t));
+	}
+
+	if (dirty != NULL) {
+		memset(dirty, 0, words * sizeof(uint64_t));
+	}
+
+	struct pager_traverse_info info = { .virtual = virtual, .size = size, .attributes = 1 << ARC_PAGER_RESV2,
+					    .dest_table = page_tables == NULL ? pml4 : page_tables, .cur_table = pml4,
+					    .any_physical = true, .no_split = true, .clear = clear, .keep_shared = !clear,
+					    .accessed = accessed, .dirty = dirty };
+
+	if (pager_traverse(&info, pager_harvest_callback) != 0) {
+		ARC_DEBUG(ERR, "Failed to harvest V0x%"PRIx64" (0x%"PRIx64" B)\n", virtual, size);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Find the entry that maps an address.
+ *
+ * @param void *page_tables - The page tables to look in.
+ * @param uintptr_t virtual - The address.
+ * @param int stop - The lowest level to go down to, the entry there may point to a table.
+ * @param int *level - Set to the level of the table holding the entry.
+ * @return a pointer to the entry, NULL if the address is not mapped.
+ * */
+static uint64_t *pager_lookup(void *page_tables, uintptr_t virtual, int stop, int *level) {
+	uint64_t *table = (uint64_t *)ALIGN_DOWN(page_tables, PAGE_SIZE);
+
+	for (int i = 4; i > 0; i--) {
+		uint64_t *entry = &table[(virtual >> (((i - 1) * 9) + 12)) & 0x1FF];
+
+		if ((*entry & 1) == 0) {
+			return NULL;
+		}
+
+		if (i <= stop || (i < 4 && ((*entry >> 7) & 1) == 1)) {
+			*level = i;
+			return entry;
+		}
+
+		table = (uint64_t *)ARC_PHYS_TO_HHDM(*entry & ADDRESS_MASK);
+	}
+
+	return NULL;
+}
+
+/**
+ * Get the smaller page at an address within a huge page.
+ *
+ * @param uint64_t entry - The huge page.
+ * @param int level - The level of the table holding it (3 for 1 GiB, 2 for 2 MiB).
+ * @param int to - The level of the smaller page, below level.
+ * @param uintptr_t virtual - The address.
+ * @return the smaller page.
+ * */
+static uint64_t pager_huge_part(uint64_t entry, int level, int to, uintptr_t virtual) {
+	uint64_t size = level == 3 ? ONE_GIB : TWO_MIB;
+	uint64_t part = to == 2 ? TWO_MIB : PAGE_SIZE;
+	uint64_t address = (entry & ADDRESS_MASK & ~(size - 1)) + ALIGN_DOWN(virtual & (size - 1), part);
+	uint64_t bits = entry & ~(ADDRESS_MASK & ~(size - 1));
+
+	if (to == 1) {
+		bits &= ~((1ULL << 7) | (1ULL << 12));
+		bits |= ((entry >> 12) & 1) << 7;
+	}
+
+	return address | bits;
+}
+
+static int pager_clone_callback(struct pager_traverse_info *info, uint64_t *table, int index, int level) {
+	if (info == NULL || table == NULL || level == 0) {
+		return -1;
+	}
+
+	// NOTE: info->physical is the address in the source tables
+	uint64_t *pml4 = (uint64_t *)ALIGN_DOWN(info->src_table, PAGE_SIZE);
+	uint64_t top = __atomic_load_n(&pml4[(info->physical >> 39) & 0x1FF], __ATOMIC_ACQUIRE);
+
+	if ((top & 1) == 0) {
+		return 0;
+	}
+
+	// The source tables are not walked by the traversal, keep them from
+	// being freed while looked at
+	struct pager_slot *slot = pager_slot(top);
+	pager_slot_enter(slot);
+
+	int src_level = 0;
+	uint64_t *src = pager_lookup(info->src_table, info->physical, level, &src_level);
+	uint64_t entry = 0;
+	int ret = 0;
+
+	if (src != NULL) {
+		entry = __atomic_load_n(src, __ATOMIC_RELAXED);
+	}
+
+	if (src_level > level) {
+		entry = pager_huge_part(entry, src_level, level, info->physical);
+	} else if ((entry & 1) == 1 && (level == 1 || ((entry >> 7) & 1) == 1)
+		   && (entry & (ENTRY_COW | ENTRY_SHARED)) != 0 && (entry & ADDRESS_MASK) != pager_zero_page) {
+		// A shared page, the copy is one more mapping of it, which its
+		// unmap drops again
+		spinlock_lock(&pager_share_lock);
+
+		// Unmapping clears the entry before dropping its count
+		entry = __atomic_load_n(src, __ATOMIC_ACQUIRE);
+
+		if ((entry & 1) == 1 && (entry & (ENTRY_COW | ENTRY_SHARED)) != 0) {
+			ret = pager_share_get_locked(entry & ADDRESS_MASK);
+		}
+
+		spinlock_unlock(&pager_share_lock);
+	} else if (level > 1 && (entry & 1) == 1 && ((entry >> 7) & 1) == 0) {
+		// A whole table, share it instead of copying what is below
+		spinlock_lock(&pager_share_lock);
+
+		// Unsharing replaces the table under the lock
+		entry = __atomic_load_n(src, __ATOMIC_ACQUIRE);
+		ret = pager_share_get_locked(entry & ADDRESS_MASK);
+
+		if (ret == 0) {
+			__atomic_fetch_or(src, ENTRY_SHARED_TABLE, __ATOMIC_ACQ_REL);
+			entry |= ENTRY_SHARED_TABLE;
+		}
+
+		spinlock_unlock(&pager_share_lock);
+	}
+
+	pager_slot_leave(slot, false);
+
+	if (ret != 0 || (entry & 1) == 0) {
+		return ret;
+	}
+
+	if (table[index] != 0 && MASKED_READ(info->attributes, ARC_PAGER_OVW, 1) == 0) {
+		ARC_DEBUG(ERR, "Cannot overwrite\n");
+
+		if ((entry & (ENTRY_SHARED_TABLE | ENTRY_COW | ENTRY_SHARED)) != 0 && (entry & ADDRESS_MASK) != pager_zero_page) {
+			pager_share_put(entry & ADDRESS_MASK);
+		}
+
+		return -2;
+	}
+
+	uint64_t old = pager_set_entry(&table[index], entry);
+
+	if ((old >> 5) & 1) {
+		pager_invalidate(info, level);
+	}
+
+	return 0;
+}
+
+/**
+ * Share the PML3 table of a 512 GiB region with other page tables.
+ *
+ * @param uint64_t *dest - The destination PML4.
+ * @param uint64_t *src - The source PML4.
+ * @param uintptr_t virt_src - The start of the region in the source.
+ * @param uintptr_t virt_dest - The start of the region in the destination.
+ * @return zero on success, non-zero if the region has to be walked instead.
+ * */
+static int pager_clone_pml3(uint64_t *dest, uint64_t *src, uintptr_t virt_src, uintptr_t virt_dest) {
+	uint64_t *from = &src[(virt_src >> 39) & 0x1FF];
+	uint64_t *to = &dest[(virt_dest >> 39) & 0x1FF];
+	uint64_t top = __atomic_load_n(from, __ATOMIC_ACQUIRE);
+
+	if ((top & 1) == 0) {
+		// Nothing to clone
+		return 0;
+	}
+
+	if ((__atomic_load_n(to, __ATOMIC_ACQUIRE) & 1) == 1) {
+		return 1;
 	}
 
-	return 0;
-}
+	struct pager_slot *slot = pager_slot(top);
+	pager_slot_enter(slot);
 
-static int pager_unmap_callback(struct pager_traverse_info *info, uint64_t *table, int index, int level) {
-	if (info == NULL || table == NULL || level == 0) {
-		return -1;
+	int ret = 1;
+	uint64_t entry = 0;
+
+	spinlock_lock(&pager_share_lock);
+
+	entry = __atomic_load_n(from, __ATOMIC_ACQUIRE);
+
+	if ((entry & ADDRESS_MASK) == (top & ADDRESS_MASK) && pager_share_get_locked(entry & ADDRESS_MASK) == 0) {
+		__atomic_fetch_or(from, ENTRY_SHARED_TABLE, __ATOMIC_ACQ_REL);
+		entry |= ENTRY_SHARED_TABLE;
+		ret = 0;
 	}
 
-	if (info->physical == 0) {
-		info->physical = table[index] & ADDRESS_MASK;
+	spinlock_unlock(&pager_share_lock);
+	pager_slot_leave(slot, false);
+
+	if (ret != 0) {
+		return ret;
 	}
 
-        bool A = ((table[index] >> 5) & 1) && info->dest_table == info->cur_table;
-        
-	table[index] = 0;
+	uint64_t expected = 0;
 
-	if (A) {
-		__asm__("invlpg %0" : : "m"(info->virtual) : );
+	if (!__atomic_compare_exchange_n(to, &expected, entry, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		// Filled in meanwhile, merge into it instead
+		pager_share_put(entry & ADDRESS_MASK);
+		return 1;
 	}
 
 	return 0;
 }
 
-int pager_unmap(void *page_tables, uintptr_t virtual, size_t size, void **physical) {
+int pager_clone(void *dest, void *src, uintptr_t virt_src, uintptr_t virt_dest, size_t size) {
 	void *pml4 = (void *)ARC_PHYS_TO_HHDM(_x86_getCR3());
-	struct pager_traverse_info info = { .virtual = virtual, .physical = 0, .size = size, 
-					    .dest_table = page_tables == NULL ? pml4 : page_tables, .cur_table = pml4 };
 
-	if (pager_traverse(&info, pager_unmap_callback) != 0) {
-		ARC_DEBUG(ERR, "Failed to map V0x%"PRIx64" (0x%"PRIx64" B)\n", virtual, size);
-		return -1;
+	void *src_table = src == NULL ? pml4 : src;
+	void *dest_table = dest == NULL ? pml4 : dest;
+
+	// NOTE: Tables and huge pages are taken over as they are where the
+	//       source and destination addresses are aligned alike, elsewhere
+	//       the walk goes down to the pages of the size both can use
+	const uint64_t span = 1ULL << 39;
+	int ret = 0;
+
+	size = ALIGN_UP(size, PAGE_SIZE);
+
+	while (size > 0) {
+		size_t chunk = span - (virt_dest & (span - 1));
+		chunk = chunk < size ? chunk : size;
+
+		if (chunk == span && (virt_src & (span - 1)) == 0 && virt_src < KERNEL_HALF && virt_dest < KERNEL_HALF
+		    && pager_clone_pml3((uint64_t *)ALIGN_DOWN(dest_table, PAGE_SIZE), (uint64_t *)ALIGN_DOWN(src_table, PAGE_SIZE), virt_src, virt_dest) == 0) {
+			goto next;
+		}
+
+		struct pager_traverse_info info = { .physical = virt_src, .virtual = virt_dest, .size = chunk,
+						    .src_table = src_table, .dest_table = dest_table, .cur_table = pml4 };
+
+		if (pager_traverse(&info, pager_clone_callback) != 0) {
+			ret = -1;
+			break;
+		}
+
+		next:;
+
+		virt_src += chunk;
+		virt_dest += chunk;
+		size -= chunk;
 	}
 
-	if (physical != NULL) {
-		*physical = (void *)info.physical;
+	if (ret != 0) {
+		ARC_DEBUG(ERR, "Failed to clone V0x%"PRIx64" to V0x%"PRIx64" for %lu bytes\n", virt_src, virt_dest, size);
 	}
 
-	return 0;
+	return ret;
 }
 
-static int pager_fly_map_callback(struct pager_traverse_info *info, uint64_t *table, int index, int level) {
+static int pager_cow_mark_callback(struct pager_traverse_info *info, uint64_t *table, int index, int level) {
 	if (info == NULL || table == NULL || level == 0) {
-		ARC_DEBUG(ERR, "Invalid parameters\n");
 		return -1;
 	}
 
-	void *page = pmm_fast_page_alloc();
+	uint64_t entry = __atomic_load_n(&table[index], __ATOMIC_RELAXED);
+	uint64_t physical = entry & ADDRESS_MASK;
 
-	if (page == NULL) {
-		ARC_DEBUG(ERR, "Failed to allocate a page\n");
-		return -2;
+	if ((entry & 1) == 0 || physical == pager_zero_page || (entry & (ENTRY_COW | ENTRY_SHARED)) != 0) {
+		// Pages that are still zero are copied on write in either table
+		// on their own, and shared pages are already marked. The count
+		// is taken by pager_clone for the copy.
+		return 0;
 	}
 
-        bool A = ((table[index] >> 5) & 1) && info->dest_table == info->cur_table;
-        
-	table[index] = ARC_HHDM_TO_PHYS(page) | get_entry_bits(level, info->attributes);
+	uint64_t new = 0;
+
+	// Retry until no accessed or dirty bit is set in between
+	do {
+		if ((entry & 1) == 0 || (entry & ADDRESS_MASK) != physical) {
+			// Unmapped in the meantime
+			return 0;
+		}
+
+		if (((entry >> 1) & 1) == 1) {
+			new = (entry & ~(1ULL << 1)) | ENTRY_COW;
+		} else {
+			new = entry | ENTRY_SHARED;
+		}
+	} while (!__atomic_compare_exchange_n(&table[index], &entry, new, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
 
-	if (A) {
-		__asm__("invlpg %0" : : "m"(info->virtual) : );
+	if ((entry >> 5) & 1) {
+		pager_invalidate(info, level);
 	}
 
 	return 0;
 }
 
-int pager_fly_map(void *page_tables, uintptr_t virtual, size_t size, uint32_t attributes) {
-	attributes |= 1 << ARC_PAGER_4K;
-
+int pager_clone_cow(void *dest, void *src, uintptr_t virtual, size_t size) {
 	void *pml4 = (void *)ARC_PHYS_TO_HHDM(_x86_getCR3());
-	struct pager_traverse_info info = { .virtual = virtual, .size = size, .attributes = attributes, 
-					    .dest_table = page_tables == NULL ? pml4 : page_tables, .cur_table = pml4 };
+	void *src_table = src == NULL ? pml4 : src;
 
-	if (pager_traverse(&info, pager_fly_map_callback) != 0) {
-		ARC_DEBUG(ERR, "Failed to fly map 0x%"PRIx64" (0x%"PRIx64" B, 0x%x)\n", virtual, size, attributes);
+	struct pager_traverse_info info = { .virtual = virtual, .size = size, .attributes = (1 << ARC_PAGER_4K) | (1 << ARC_PAGER_RESV2),
+					    .dest_table = src_table, .cur_table = pml4, .any_physical = true };
+
+	if (pager_traverse(&info, pager_cow_mark_callback) != 0) {
+		ARC_DEBUG(ERR, "Failed to share V0x%"PRIx64" (0x%"PRIx64" B)\n", virtual, size);
 		return -1;
 	}
 
-	return 0;
+	return pager_clone(dest, src, virtual, virtual, size);
 }
 
-static int pager_fly_unmap_callback(struct pager_traverse_info *info, uint64_t *table, int index, int level) {
+static int pager_cow_fault_callback(struct pager_traverse_info *info, uint64_t *table, int index, int level) {
 	if (info == NULL || table == NULL || level == 0) {
 		return -1;
 	}
 
-        bool A = ((table[index] >> 5) & 1) && info->dest_table == info->cur_table;
-	pmm_fast_page_free((void *)ARC_PHYS_TO_HHDM(table[index] & ADDRESS_MASK));
-	table[index] = 0;
+	// Allocated up front, as the share lock is held until the entry is
+	// replaced so no other mapping can take the page over mid copy
+	void *page = pager_alloc_zeroed();
 
-	if (A) {
-		__asm__("invlpg %0" : : "m"(info->virtual) : );
+	if (page == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate page\n");
+		return -2;
 	}
 
-	return 0;
-}
+	bool used = false;
+	bool zeroed = true;
+	int ret = 0;
 
-int pager_fly_unmap(void *page_tables, uintptr_t virtual, size_t size) {
-	void *pml4 = (void *)ARC_PHYS_TO_HHDM(_x86_getCR3());
+	spinlock_lock(&pager_share_lock);
 
-	struct pager_traverse_info info = { .virtual = virtual, .size = size, 
-					     .dest_table = page_tables == NULL ? pml4 : page_tables, .cur_table = pml4 };
+	uint64_t entry = __atomic_load_n(&table[index], __ATOMIC_ACQUIRE);
 
-	if (pager_traverse(&info, pager_fly_unmap_callback) != 0) {
-		ARC_DEBUG(ERR, "Failed to map V0x%"PRIx64" (0x%"PRIx64" B)\n", virtual, size);
-		return -1;
+	if ((entry & 1) == 0 || (entry & ENTRY_COW) == 0) {
+		// Another processor may have resolved the fault already
+		ret = (entry & 0b11) == 0b11 ? 0 : -1;
+		goto done;
 	}
 
-	return 0;
-}
+	uint64_t physical = entry & ADDRESS_MASK;
+	struct pager_share **link = NULL;
+	struct pager_share *share = NULL;
+
+	if (physical == pager_zero_page) {
+		// First write to a lazy mapping
+		used = true;
+	} else if ((share = pager_share_find(physical, &link)) != NULL) {
+		// Others still map the page, make a copy of it
+		memcpy(page, (void *)ARC_PHYS_TO_HHDM(physical), PAGE_SIZE);
+		used = true;
+		zeroed = false;
+	}
 
-static int pager_set_attr_callback(struct pager_traverse_info *info, uint64_t *table, int index, int level) {
-	if (info == NULL || table == NULL || level == 0) {
-		return -1;
+	uint64_t address = used ? ARC_HHDM_TO_PHYS(page) : physical;
+	uint64_t new = 0;
+
+	// Retry until no accessed or dirty bit is set in between
+	do {
+		if ((entry & ENTRY_COW) == 0 || (entry & ADDRESS_MASK) != physical) {
+			// Unmapped in the meantime
+			used = false;
+			ret = -1;
+			goto done;
+		}
+
+		new = address | (entry & ~ADDRESS_MASK & ~ENTRY_COW) | (1 << 1);
+	} while (!__atomic_compare_exchange_n(&table[index], &entry, new, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	if (share != NULL && --share->count <= 1) {
+		// A single mapping is left, it owns the page from here on
+		*link = share->next;
+		free(share);
 	}
-        
-        bool A = ((table[index] >> 5) & 1) && info->dest_table == info->cur_table;
-	uint64_t address = table[index] & ADDRESS_MASK;
-	table[index] = address | get_entry_bits(level, info->attributes);
 
-	if (A) {
-		__asm__("invlpg %0" : : "m"(info->virtual) : );
+	done:;
+
+	spinlock_unlock(&pager_share_lock);
+
+	if (!used) {
+		if (zeroed) {
+			pager_free_zeroed(page);
+		} else {
+			pmm_fast_page_free(page);
+		}
 	}
 
-	return 0;
+	if (ret == 0 && (entry & ENTRY_COW) != 0) {
+		// The read only entry may be cached anywhere the tables are loaded
+		pager_invalidate(info, level);
+		ARC_PAGER_COUNT(cow_faults, 1);
+	}
+
+	return ret;
 }
 
-int pager_set_attr(void *page_tables, uintptr_t virtual, size_t size, uint32_t attributes) {
+int pager_resolve_cow(void *page_tables, uintptr_t virtual) {
 	void *pml4 = (void *)ARC_PHYS_TO_HHDM(_x86_getCR3());
-	struct pager_traverse_info info = { .virtual = virtual, .size = size, .attributes = attributes, 
-					    .dest_table = page_tables == NULL ? pml4 : page_tables, .cur_table = pml4 };
+	struct pager_traverse_info info = { .virtual = ALIGN_DOWN(virtual, PAGE_SIZE), .size = PAGE_SIZE,
+					    .attributes = (1 << ARC_PAGER_4K) | (1 << ARC_PAGER_RESV2),
+					    .dest_table = page_tables == NULL ? pml4 : page_tables, .cur_table = pml4,
+					    .any_physical = true };
 
-	if (pager_traverse(&info, pager_set_attr_callback) != 0) {
-		ARC_DEBUG(ERR, "Failed to set attr V0x%"PRIx64" (0x%"PRIx64" B, 0x%x)\n", virtual, size, attributes);
+	if (pager_traverse(&info, pager_cow_fault_callback) != 0) {
 		return -1;
 	}
 
 	return 0;
 }
 
-// ERROR: When servicing a fault and needing to clone a userspace entry,
-//        the following output is given:
-//        pml4=0xffffc00255612002
-//        pml3=0x0000800000025000
-//        pml3=0x0000400000025000
+/**
+ * Describe the page an entry maps.
+ *
+ * @param uint64_t entry - The leaf entry.
+ * @param int level - The level of the table holding it.
+ * @param uintptr_t virtual - The address being translated.
+ * @param ARC_PagerTranslation *translation - Filled in.
+ * */
+static void pager_describe(uint64_t entry, int level, uintptr_t virtual, ARC_PagerTranslation *translation) {
+	size_t size = (size_t)1 << (((level - 1) * 9) + 12);
+	uint64_t pat = level == 1 ? (entry >> 7) & 1 : (entry >> 12) & 1;
+	uint32_t attributes = 0;
+
+	attributes |= ((entry >> 1) & 1) << ARC_PAGER_RW;
+	attributes |= ((entry >> 2) & 1) << ARC_PAGER_US;
+	attributes |= ((entry >> 63) & 1) << ARC_PAGER_NX;
+	attributes |= (((entry >> 3) & 1) | (((entry >> 4) & 1) << 1) | (pat << 2)) << ARC_PAGER_PAT;
+	attributes |= (level == 1) << ARC_PAGER_4K;
+	attributes |= ((entry >> 59) & 0xF) << ARC_PAGER_PKEY;
+	attributes |= ((entry >> 8) & 1) << ARC_PAGER_GLOBAL;
+
+	translation->physical = (entry & ADDRESS_MASK & ~(size - 1)) + (virtual & (size - 1));
+	translation->page_size = size;
+	translation->attributes = attributes;
+}
 
-static int pager_clone_callback(struct pager_traverse_info *info, uint64_t *table, int index, int level) {
-	if (info == NULL || table == NULL || level == 0) {
+size_t pager_query(void *page_tables, const uintptr_t *virtual, ARC_PagerTranslation *translations, size_t count) {
+	if (virtual == NULL || translations == NULL) {
+		return count;
+	}
+
+	void *pml4 = (void *)ARC_PHYS_TO_HHDM(_x86_getCR3());
+	uint64_t *tables = (uint64_t *)ALIGN_DOWN(page_tables == NULL ? pml4 : page_tables, PAGE_SIZE);
+	uint64_t key = ARC_HHDM_TO_PHYS(tables);
+	bool cache = smp_registered();
+	size_t unmapped = 0;
+
+	bool I = arch_interrupts_enabled();
+	ARC_DISABLE_INTERRUPT;
+
+	for (size_t i = 0; i < count; i++) {
+		uintptr_t page = ALIGN_DOWN(virtual[i], PAGE_SIZE);
+		int line = (page >> PAGE_SIZE_LOWEST_EXPONENT) & (ARC_PAGER_XLAT_SIZE - 1);
+
+		if (cache) {
+			ARC_x64CachedTranslation cached = Arc_CurProcessorDescriptor->xlat.entries[line];
+
+			if (cached.tables == key && cached.virtual == page
+			    && cached.generation == __atomic_load_n(&pager_slots[cached.slot].generation, __ATOMIC_ACQUIRE)) {
+				pager_describe(cached.entry, cached.level, virtual[i], &translations[i]);
+				continue;
+			}
+		}
+
+		uint64_t top = __atomic_load_n(&tables[(page >> 39) & 0x1FF], __ATOMIC_ACQUIRE);
+		uint64_t entry = 0;
+		int level = 0;
+
+		if ((top & 1) == 1) {
+			// The generation is read before the walk, so a change made
+			// during the walk leaves the cached translation out of date
+			struct pager_slot *slot = pager_slot(top);
+			pager_slot_enter(slot);
+			uint32_t generation = __atomic_load_n(&slot->generation, __ATOMIC_ACQUIRE);
+
+			uint64_t *found = pager_lookup(tables, page, 1, &level);
+
+			if (found != NULL) {
+				entry = __atomic_load_n(found, __ATOMIC_RELAXED);
+			}
+
+			pager_slot_leave(slot, false);
+
+			if ((entry & 1) == 1 && cache) {
+				Arc_CurProcessorDescriptor->xlat.entries[line] = (ARC_x64CachedTranslation){
+					.tables = key, .virtual = page, .entry = entry, .generation = generation,
+					.slot = slot - pager_slots, .level = level
+				};
+			}
+		}
+
+		if ((entry & 1) == 0) {
+			translations[i] = (ARC_PagerTranslation){ 0 };
+			unmapped++;
+			continue;
+		}
+
+		pager_describe(entry, level, virtual[i], &translations[i]);
+	}
+
+	if (I) {
+		ARC_ENABLE_INTERRUPT;
+	}
+
+	return unmapped;
+}
+
+int pager_translate(void *page_tables, uintptr_t virtual, uintptr_t *physical) {
+	ARC_PagerTranslation translation = { 0 };
+
+	if (pager_query(page_tables, &virtual, &translation, 1) != 0) {
 		return -1;
 	}
 
-        bool A = true;
-        
-//	printf("pml4=%p\n", info->src_table);
+	if (physical != NULL) {
+		*physical = translation.physical;
+	}
+
+	return 0;
+}
+
+/**
+ * Check whether the entries of a table map contiguous memory uniformly.
+ *
+ * The accessed and dirty bits may differ between the entries, the huge page
+ * gets them if any of the entries have them.
+ *
+ * @param uint64_t *table - The table to check.
+ * @param int level - The level of the table (1 for a PT, 2 for a PD).
+ * @return the huge page equivalent to the table, zero if there is none.
+ * */
+static uint64_t pager_collapsible(uint64_t *table, int level) {
+	uint64_t size = level == 1 ? TWO_MIB : ONE_GIB;
+	uint64_t step = size >> 9;
+	uint64_t mask = ADDRESS_MASK & ~(step - 1);
+	uint64_t first = table[0];
+	uint64_t address = first & mask;
+	uint64_t bits = first & ~mask & ~ENTRY_ACCESSED_DIRTY;
+	uint64_t accessed = 0;
+
+	if ((first & 1) == 0 || (first & ENTRY_SOFTWARE_BITS) != 0 || (address & (size - 1)) != 0) {
+		return 0;
+	}
 
-	uint64_t *pml3 = NULL;
-	if ((pml3 = (uint64_t *)(info->src_table[info->pml4e] & ADDRESS_MASK)) == NULL) {
+	if (level == 2 && ((first >> 7) & 1) == 0) {
+		// The entries must be 2 MiB pages, not tables
 		return 0;
 	}
 
-//	printf("pml3=%p\n", pml3);
+	for (int i = 0; i < 512; i++) {
+		uint64_t entry = table[i];
 
-	pml3 = (uint64_t *)ARC_PHYS_TO_HHDM(pml3);
+		if ((entry & mask) != address + (i * step) || (entry & ~mask & ~ENTRY_ACCESSED_DIRTY) != bits) {
+			return 0;
+		}
 
-//	printf("pml3=%p\n", pml3);
+		accessed |= entry & ENTRY_ACCESSED_DIRTY;
+	}
 
-	uint64_t *pml2 = NULL;
-	if ((pml2 = (uint64_t *)(pml3[info->pml3e] & ADDRESS_MASK)) == NULL) {
-		return 0;
+	if (level == 1) {
+		// Huge pages have the PAT bit at bit 12 and the page size bit
+		// where the PAT bit was
+		bits = (bits & ~(1ULL << 7)) | (((first >> 7) & 1) << 12) | (1ULL << 7);
 	}
 
-	if (((pml3[info->pml3e] >> 7) & 1) == 1) {
-		if (table[index] != 0 && MASKED_READ(info->attributes, ARC_PAGER_OVW, 1) == 0) {
-			ARC_DEBUG(ERR, "Cannot overwrite\n");
-			return -2;
+	return address | bits | accessed;
+}
+
+/**
+ * Give a huge page the restrictions of the directory entry it replaces.
+ *
+ * @param uint64_t directory - The directory entry.
+ * @param uint64_t huge - The huge page.
+ * @return the huge page with the restrictions applied.
+ * */
+static uint64_t pager_inherit(uint64_t directory, uint64_t huge) {
+	huge &= ~(~directory & 0b110); // R/W, U/S
+	huge |= directory & (1ULL << 63); // XD
+
+	return huge;
+}
+
+int pager_collapse(void *page_tables, uintptr_t virtual, size_t size) {
+	void *pml4 = (void *)ARC_PHYS_TO_HHDM(_x86_getCR3());
+	void *dest_table = page_tables == NULL ? pml4 : page_tables;
+	uint64_t *pml4_table = (uint64_t *)ALIGN_DOWN(dest_table, PAGE_SIZE);
+
+	ARC_TLBBatch batch;
+	pager_batch_init(&batch, dest_table, pml4, virtual);
+
+	// Tables are only freed once no processor can be walking them anymore
+	uint64_t *freed[ARC_TLB_BATCH_RANGES];
+	int freed_count = 0;
+	int collapsed = 0;
+
+	uintptr_t base = ALIGN_DOWN(virtual, TWO_MIB);
+	size += virtual - base;
+
+	while (size) {
+		uint64_t skip = 0;
+		uint64_t *pml3 = NULL;
+		uint64_t *pml2 = NULL;
+		int pml3e = (base >> 30) & 0x1FF;
+		int pml2e = (base >> 21) & 0x1FF;
+
+		struct pager_slot *slot = NULL;
+		bool I = false;
+		uint64_t entry = __atomic_load_n(&pml4_table[(base >> 39) & 0x1FF], __ATOMIC_ACQUIRE);
+
+		if ((entry & 1) == 0) {
+			skip = (1ULL << 39) - (base & ((1ULL << 39) - 1));
+			goto next;
+		}
+
+		// Tables that are being walked stay for a later pass
+		I = arch_interrupts_enabled();
+		ARC_DISABLE_INTERRUPT;
+
+		slot = pager_slot(entry);
+
+		if (!pager_slot_try_lock(slot)) {
+			slot = NULL;
+			skip = ONE_GIB - (base & (ONE_GIB - 1));
+			goto next;
+		}
+
+		if (pml4_table[(base >> 39) & 0x1FF] != entry || (entry & ENTRY_SHARED_TABLE) != 0) {
+			// Released, or shared with other page tables that still
+			// use the tables below
+			skip = (1ULL << 39) - (base & ((1ULL << 39) - 1));
+			goto next;
+		}
+
+		pml3 = (uint64_t *)ARC_PHYS_TO_HHDM(entry & ADDRESS_MASK);
+		entry = pml3[pml3e];
+
+		if ((entry & 1) == 0 || ((entry >> 7) & 1) == 1 || (entry & ENTRY_SHARED_TABLE) != 0) {
+			skip = ONE_GIB - (base & (ONE_GIB - 1));
+			goto next;
+		}
+
+		pml2 = (uint64_t *)ARC_PHYS_TO_HHDM(entry & ADDRESS_MASK);
+		entry = pml2[pml2e];
+		skip = TWO_MIB;
+
+		if ((entry & 1) == 1 && ((entry >> 7) & 1) == 0 && (entry & ENTRY_SHARED_TABLE) == 0) {
+			uint64_t *pml1 = (uint64_t *)ARC_PHYS_TO_HHDM(entry & ADDRESS_MASK);
+			uint64_t huge = pager_collapsible(pml1, 1);
+
+			if (huge != 0) {
+				pml2[pml2e] = pager_inherit(entry, huge);
+				tlb_batch_add(&batch, base, 21);
+				freed[freed_count++] = pml1;
+				collapsed++;
+			}
+		}
+
+		if ((pml2e == 511 || size <= TWO_MIB) && ARC_CHECK_FEATURE(paging, ARC_PAGER_FLAG_GIB)) {
+			// Done with this directory, see if it can go too
+			uint64_t huge = pager_collapsible(pml2, 2);
+
+			if (huge != 0) {
+				pml3[pml3e] = pager_inherit(pml3[pml3e], huge);
+				tlb_batch_add(&batch, ALIGN_DOWN(base, ONE_GIB), 30);
+				freed[freed_count++] = pml2;
+				collapsed++;
+			}
+		}
+
+		next:;
+
+		if (slot != NULL) {
+			pager_slot_unlock(slot);
+		}
+
+		if (I) {
+			ARC_ENABLE_INTERRUPT;
+		}
+
+		if (freed_count >= ARC_TLB_BATCH_RANGES - 1 || skip >= size) {
+			// A single invalidation per collapsed table also drops the
+			// cached pointers to the tables, after which they can go
+			tlb_batch_flush(&batch);
+
+			for (int i = 0; i < freed_count; i++) {
+				pmm_fast_page_free(freed[i]);
+			}
+
+			ARC_PAGER_COUNT(tables_freed, freed_count);
+			ARC_PAGER_COUNT(collapses, freed_count);
+
+			freed_count = 0;
+		}
+
+		if (skip >= size) {
+			break;
 		}
-		// 1 GiB page
-                A = ((table[index] >> 5) & 1) && info->dest_table == info->cur_table;
-		table[index] = pml3[info->pml3e];
-		goto basic_quit;
+
+		base += skip;
+		size -= skip;
 	}
 
-	pml2 = (uint64_t *)ARC_PHYS_TO_HHDM(pml2);
-//	printf("pml2=%p\n", pml3);
+	return collapsed;
+}
+
+static uintptr_t pager_collapse_cursor = ARC_PAGER_COLLAPSE_START;
+static bool pager_collapse_busy = false;
 
-	uint64_t *pml1 = NULL;
-	if ((pml1 = (uint64_t *)(pml2[info->pml2e] & ADDRESS_MASK)) == NULL) {
-		return 0;
+void pager_collapse_idle() {
+	if (Arc_KernelPageTables == 0 || __atomic_test_and_set(&pager_collapse_busy, __ATOMIC_ACQUIRE)) {
+		return;
 	}
 
-	if (((pml2[info->pml2e] >> 7) & 1) == 1) {
-		if (table[index] != 0 && MASKED_READ(info->attributes, ARC_PAGER_OVW, 1) == 0) {
-			ARC_DEBUG(ERR, "Cannot overwrite\n");
-			return -2;
+	uint64_t *pml4 = (uint64_t *)ARC_PHYS_TO_HHDM(Arc_KernelPageTables);
+
+	// NOTE: This runs on every idle tick, so go straight to the next part
+	//       that is mapped rather than spending whole ticks on empty
+	//       512 GiB regions
+	for (int i = 0; i < 256 && (__atomic_load_n(&pml4[(pager_collapse_cursor >> 39) & 0x1FF], __ATOMIC_RELAXED) & 1) == 0; i++) {
+		pager_collapse_cursor = ALIGN_DOWN(pager_collapse_cursor, 1ULL << 39) + (1ULL << 39);
+
+		if (pager_collapse_cursor == 0) {
+			pager_collapse_cursor = ARC_PAGER_COLLAPSE_START;
 		}
-		// 2 MiB page
-                A = ((table[index] >> 5) & 1) && info->dest_table == info->cur_table;
-		table[index] = pml2[info->pml2e];
-		goto basic_quit;
 	}
 
-	pml1 = (uint64_t *)ARC_PHYS_TO_HHDM(pml1);
+	pager_collapse(pml4, pager_collapse_cursor, ONE_GIB);
 
-//	printf("pml2=%p\n", pml1);
+	pager_collapse_cursor += ONE_GIB;
 
-	if ((pml1[info->pml1e] & ADDRESS_MASK) == 0) {
-		return 0;
+	if (pager_collapse_cursor == 0) {
+		// Wrapped past the top of the address space
+		pager_collapse_cursor = ARC_PAGER_COLLAPSE_START;
 	}
 
-	if (table[index] != 0 && MASKED_READ(info->attributes, ARC_PAGER_OVW, 1) == 0) {
-		ARC_DEBUG(ERR, "Cannot overwrite\n");
-		return -2;
+	__atomic_clear(&pager_collapse_busy, __ATOMIC_RELEASE);
+}
+
+void pager_counters(ARC_PagerCounters *total) {
+	if (total == NULL) {
+		return;
 	}
 
-	// 4 KiB page
-        A = ((table[index] >> 5) & 1) && info->dest_table == info->cur_table;
-	table[index] = pml1[info->pml1e];
+	memset(total, 0, sizeof(*total));
 
-	basic_quit:;
+	for (uint32_t i = 0; i < Arc_ProcessorCounter; i++) {
+		ARC_x64ProcessorDescriptor *desc = i == 0 ? Arc_BootProcessor : &Arc_ProcessorList[i];
+		ARC_PagerCounters counters = desc->counters;
 
-	if (info->dest_table == info->cur_table) {
-		__asm__("invlpg %0" : : "m"(info->virtual) : );
+		// Every counter is a uint64_t
+		uint64_t *from = (uint64_t *)&counters;
+		uint64_t *to = (uint64_t *)total;
+
+		for (size_t j = 0; j < sizeof(counters) / sizeof(uint64_t); j++) {
+			to[j] += from[j];
+		}
 	}
+}
 
-	return 0;
+/**
+ * Describe a table and the tables below it.
+ *
+ * @param uint64_t *table - The table.
+ * @param int level - The level of the table, at most 3.
+ * @param ARC_PagerStats *stats - The description to add to.
+ * */
+static void pager_stats_table(uint64_t *table, int level, ARC_PagerStats *stats) {
+	size_t present = 0;
+
+	stats->tables[level - 1]++;
+
+	for (int i = 0; i < 512; i++) {
+		uint64_t entry = __atomic_load_n(&table[i], __ATOMIC_RELAXED);
+
+		if ((entry & 1) == 0) {
+			continue;
+		}
+
+		present++;
+
+		if (level == 1 || ((entry >> 7) & 1) == 1) {
+			stats->pages[level - 1]++;
+			stats->mapped += 1ULL << (((level - 1) * 9) + 12);
+			continue;
+		}
+
+		uint64_t *next = (uint64_t *)ARC_PHYS_TO_HHDM(entry & ADDRESS_MASK);
+
+		if ((entry & ENTRY_SHARED_TABLE) != 0) {
+			stats->shared_tables++;
+		}
+
+		if (level == 2 && pager_collapsible(next, 1) != 0) {
+			stats->mergeable++;
+		}
+
+		pager_stats_table(next, level - 1, stats);
+	}
+
+	stats->entries += present;
+
+	if (present < 512 / 8) {
+		stats->sparse_tables++;
+	}
 }
 
-int pager_clone(void *dest, void *src, uintptr_t virt_src, uintptr_t virt_dest, size_t size) {
+int pager_stats(void *page_tables, ARC_PagerStats *stats) {
+	if (stats == NULL) {
+		ARC_DEBUG(ERR, "No stats given\n");
+		return -1;
+	}
+
 	void *pml4 = (void *)ARC_PHYS_TO_HHDM(_x86_getCR3());
+	uint64_t *tables = (uint64_t *)ALIGN_DOWN(page_tables == NULL ? pml4 : page_tables, PAGE_SIZE);
+	size_t present = 0;
 
-	void *src_table = src == NULL ? pml4 : src;
-	void *dest_table = dest == NULL ? pml4 : dest;
+	memset(stats, 0, sizeof(*stats));
+	stats->tables[3] = 1;
 
-	struct pager_traverse_info info = { .physical = virt_src, .virtual = virt_dest, .size = size,
-					    .src_table = src_table, .dest_table = dest_table, .cur_table = pml4 };
+	for (int i = 0; i < 512; i++) {
+		uint64_t entry = __atomic_load_n(&tables[i], __ATOMIC_ACQUIRE);
 
-	if (pager_traverse(&info, pager_clone_callback) != 0) {
-		ARC_DEBUG(ERR, "Failed to clone V0x%"PRIx64" to V0x%"PRIx64" for %lu bytes\n", virt_src, virt_dest, size);
-		return -1;
+		if ((entry & 1) == 0) {
+			continue;
+		}
+
+		// Keep the tables below from being freed while they are counted
+		struct pager_slot *slot = pager_slot(entry);
+		pager_slot_enter(slot);
+
+		if (__atomic_load_n(&tables[i], __ATOMIC_ACQUIRE) == entry) {
+			present++;
+
+			if ((entry & ENTRY_SHARED_TABLE) != 0) {
+				stats->shared_tables++;
+			}
+
+			pager_stats_table((uint64_t *)ARC_PHYS_TO_HHDM(entry & ADDRESS_MASK), 3, stats);
+		}
+
+		pager_slot_leave(slot, false);
+	}
+
+	stats->entries += present;
+
+	if (present < 512 / 8) {
+		stats->sparse_tables++;
 	}
 
 	return 0;
 }
 
 int init_pager() {
+	init_static_spinlock(&pager_share_lock);
+	init_static_spinlock(&pager_kernel_half_lock);
+	init_static_spinlock(&pager_zero_pool_lock);
+
+	uint32_t eax, ebx, ecx, edx;
+
+#if ARC_PAGER_SHARE_KERNEL_HALF == 2
+	pager_share_kernel = true;
+#elif ARC_PAGER_SHARE_KERNEL_HALF == 1
+	// Only processors that are not affected by Meltdown can have the
+	// kernel mapped while running userspace
+	__cpuid(0, eax, ebx, ecx, edx);
+
+	if (eax >= 7) {
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+		if (MASKED_READ(edx, 29, 1)) {
+			pager_share_kernel = MASKED_READ(_x86_RDMSR(0x10A), 0, 1); // IA32_ARCH_CAPABILITIES.RDCL_NO
+		}
+	}
+#endif
+
+	if (pager_share_kernel) {
+		ARC_DEBUG(INFO, "Sharing kernel half with new page tables\n");
+
+		__cpuid(1, eax, ebx, ecx, edx);
+		pager_global = MASKED_READ(edx, 13, 1); // PGE
+
+		if (pager_global) {
+			ARC_DEBUG(INFO, "Mapping kernel half global\n");
+		}
+
+		pager_set_shared_entry(ARC_PAGER_SHARED_ENTRY);
+	}
+
+	void *zero = pmm_fast_page_alloc();
+
+	if (zero == NULL) {
+		ARC_DEBUG(ERR, "Failed to allocate zero page\n");
+		return -1;
+	}
+
+	memset(zero, 0, PAGE_SIZE);
+	pager_zero_page = ARC_HHDM_TO_PHYS(zero);
+
 	ARC_DEBUG(INFO, "Initialized pager\n");
 
 	return 0;
@@ -28,6 +28,7 @@
 #include "arch/x86-64/ctrl_regs.h"
 #include "arch/x86-64/pcid.h"
 #include "arch/x86-64/smp.h"
+#include "arch/x86-64/tlb.h"
 #include "arch/x86-64/util.h"
 #include "arctan.h"
 #include "global.h"
@@ -45,34 +46,35 @@ int pcid_allocate() {
                 return -1;
         }
 
-        int pcid = 0;
+        // PCID 0 is the kernel's, handing it out would let address spaces
+        // use each other's entries
+        int pcid = -1;
+        int words = PCID_COUNT / (sizeof(*pcid_bmp) * 8);
 
-        for (int i = 0; i < PCID_COUNT / (sizeof(*pcid_bmp) * 8); i++) {
-                int _i = (i + pcid_last_free) % PCID_COUNT / 8;
-
-                if (pcid_bmp[_i] == (uint64_t)~0) {
-                        continue;
-                }
-
-                spinlock_lock(&mod_lock);
+        spinlock_lock(&mod_lock);
 
-                int x = __builtin_ffs(~pcid_bmp[_i]);
+        for (int i = 0; i < words; i++) {
+                int _i = (i + pcid_last_free) % words;
 
-                if (x == 0) {
+                if (pcid_bmp[_i] == (uint64_t)~0) {
                         continue;
                 }
 
-                x--;
+                int x = __builtin_ffsll(~pcid_bmp[_i]) - 1;
 
-                pcid_bmp[_i] |= 1 << x;
-                pcid = (i * sizeof(*pcid_bmp) * 8) + x;
+                pcid_bmp[_i] |= 1ULL << x;
+                pcid = (_i * sizeof(*pcid_bmp) * 8) + x;
                 pcid_last_free = _i;
 
-                spinlock_unlock(&mod_lock);
-
                 break;
         }
 
+        spinlock_unlock(&mod_lock);
+
+        if (pcid < 0) {
+                ARC_DEBUG(ERR, "Out of PCIDs\n");
+        }
+
         return pcid;
 }
 
@@ -82,8 +84,12 @@ void pcid_free(int pcid) {
                 return;
         }
 
+        // Entries tagged with the PCID may still be cached by any processor
+        // that ran it, drop them before the PCID can be handed out again
+        tlb_invalidate_address_space(pcid);
+
         spinlock_lock(&mod_lock);
-        pcid_bmp[pcid / (sizeof(*pcid_bmp) * 8)] &= ~(1 << (pcid % 64));
+        pcid_bmp[pcid / (sizeof(*pcid_bmp) * 8)] &= ~(1ULL << (pcid % 64));
         spinlock_unlock(&mod_lock);
 }
 
@@ -99,14 +105,14 @@ int init_pcid() {
 
         init_static_spinlock(&mod_lock);
 
-        pcid_bmp = alloc(PCID_COUNT / sizeof(*pcid_bmp) * 8);
+        pcid_bmp = alloc(PCID_COUNT / 8);
 
         if (pcid_bmp == NULL) {
                 ARC_DEBUG(ERR, "Failed to allocate memory for PCID bmp\n");
                 return -1;
         }
 
-        memset(pcid_bmp, 0, PCID_COUNT / (sizeof(*pcid_bmp) * 8));
+        memset(pcid_bmp, 0, PCID_COUNT / 8);
 
         pcid_bmp[0] |= 1;
 
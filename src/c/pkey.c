@@ -0,0 +1,150 @@
+/**
+ * @file pkey.c
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Karch-x86-64 - x86-64 Implementation of K/arch Abstractions
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Karch-x86-64.
+ *
+ * Arctan-OS/Karch-x86-64 is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Protection key allocation and access rights.
+*/
+#include "arch/x86-64/ctrl_regs.h"
+#include "arch/x86-64/pkey.h"
+#include "arctan.h"
+#include "global.h"
+#include "util.h"
+
+#include <cpuid.h>
+
+#define PKRS_MSR 0x6E1
+
+// Bit n is set if key n is allocated, key 0 always is
+static uint16_t pkey_user_keys = 1;
+static uint16_t pkey_supervisor_keys = 1;
+static bool pkey_user = false;
+static bool pkey_supervisor = false;
+
+int pkey_allocate(bool supervisor) {
+        if (!(supervisor ? pkey_supervisor : pkey_user)) {
+                ARC_DEBUG(ERR, "Protection keys not supported\n");
+                return -1;
+        }
+
+        uint16_t *keys = supervisor ? &pkey_supervisor_keys : &pkey_user_keys;
+        uint16_t current = __atomic_load_n(keys, __ATOMIC_RELAXED);
+
+        for (;;) {
+                if (current == 0xFFFF) {
+                        ARC_DEBUG(ERR, "Out of protection keys\n");
+                        return -2;
+                }
+
+                int key = __builtin_ffs(~current & 0xFFFF) - 1;
+
+                if (__atomic_compare_exchange_n(keys, &current, current | (1 << key), false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                        return key;
+                }
+        }
+}
+
+void pkey_free(int key, bool supervisor) {
+        if (key <= 0 || key >= ARC_PKEY_COUNT) {
+                return;
+        }
+
+        uint16_t *keys = supervisor ? &pkey_supervisor_keys : &pkey_user_keys;
+        __atomic_fetch_and(keys, ~(1 << key), __ATOMIC_RELEASE);
+}
+
+uint32_t pkey_read_pkru() {
+        uint32_t pkru = 0;
+        __asm__ volatile("rdpkru" : "=a"(pkru) : "c"(0) : "rdx");
+        return pkru;
+}
+
+void pkey_write_pkru(uint32_t pkru) {
+        __asm__ volatile("wrpkru" :: "a"(pkru), "c"(0), "d"(0) : "memory");
+}
+
+uint32_t pkey_read_pkrs() {
+        return (uint32_t)_x86_RDMSR(PKRS_MSR);
+}
+
+void pkey_write_pkrs(uint32_t pkrs) {
+        _x86_WRMSR(PKRS_MSR, pkrs);
+}
+
+int pkey_set_rights(int key, bool supervisor, uint32_t rights) {
+        if (key < 0 || key >= ARC_PKEY_COUNT || !(supervisor ? pkey_supervisor : pkey_user)) {
+                return -1;
+        }
+
+        // NOTE: No page table is written and nothing is invalidated, the
+        //       keys are checked on every access
+        uint32_t mask = 0b11 << (key * 2);
+        rights = (rights & 0b11) << (key * 2);
+
+        if (supervisor) {
+                pkey_write_pkrs((pkey_read_pkrs() & ~mask) | rights);
+        } else {
+                pkey_write_pkru((pkey_read_pkru() & ~mask) | rights);
+        }
+
+        return 0;
+}
+
+int pkey_get_rights(int key, bool supervisor) {
+        if (key < 0 || key >= ARC_PKEY_COUNT || !(supervisor ? pkey_supervisor : pkey_user)) {
+                return -1;
+        }
+
+        uint32_t value = supervisor ? pkey_read_pkrs() : pkey_read_pkru();
+
+        return (value >> (key * 2)) & 0b11;
+}
+
+void init_pkey() {
+        register uint32_t eax;
+        register uint32_t ebx;
+        register uint32_t ecx;
+        register uint32_t edx;
+
+        __cpuid(0, eax, ebx, ecx, edx);
+
+        if (eax < 7) {
+                return;
+        }
+
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+        if (MASKED_READ(ecx, 3, 1)) {
+                _x86_setCR4(_x86_getCR4() | (1 << 22)); // PKE
+                pkey_user = true;
+        }
+
+        if (MASKED_READ(ecx, 31, 1)) {
+                _x86_setCR4(_x86_getCR4() | (1 << 24)); // PKS
+                pkey_supervisor = true;
+        }
+
+        if (pkey_user || pkey_supervisor) {
+                ARC_DEBUG(INFO, "Protection keys enabled (user: %d, supervisor: %d)\n", pkey_user, pkey_supervisor);
+        }
+}
@@ -35,8 +35,11 @@
 #include "arch/x86-64/ctrl_regs.h"
 #include "arch/x86-64/gdt.h"
 #include "arch/x86-64/interrupt.h"
+#include "arch/x86-64/numa.h"
+#include "arch/x86-64/pager.h"
 #include "arch/x86-64/pcid.h"
 #include "arch/x86-64/smp.h"
+#include "arch/x86-64/tlb.h"
 #include "arch/x86-64/util.h"
 #include "arctan.h"
 #include "config.h"
@@ -81,8 +84,57 @@ ARC_x64ProcessorDescriptor *Arc_BootProcessor = NULL;
 USERSPACE(bss) ARC_x64ProcessorDescriptor __seg_gs *Arc_CurProcessorDescriptor = NULL;
 USERSPACE(bss) uint32_t Arc_ProcessorCounter = 0;
 
+static void smp_idle_tick(ARC_InterruptFrame *frame) {
+	(void)frame;
+
+	// Nothing to do but return to smp_hold
+	lapic_eoi();
+}
+ARC_DEFINE_IRQ_HANDLER(smp_idle_tick, Arc_KernelPageTables);
+
 void smp_hold() {
-	ARC_HANG;
+	term_draw();
+
+	if (!smp_registered()) {
+		// Left out of TLB shootdowns (see init_tlb), its entries may go
+		// stale, so nothing may run on it
+		ARC_DISABLE_INTERRUPT;
+
+		for (;;) {
+			ARC_HALT;
+		}
+	}
+
+	// Take shootdowns from here on, the idle work below changes page
+	// tables and waits on the other processors
+	ARC_ENABLE_INTERRUPT;
+	tlb_set_interruptible();
+
+	for (;;) {
+		// Make use of the time until the next interrupt, the idle tick
+		// brings the processor back here
+		pager_zero_cache_refill();
+		pager_collapse_idle();
+		ARC_HALT;
+	}
+}
+
+/**
+ * Allocate a kernel stack for the processor being registered.
+ *
+ * The stacks are used on every interrupt and syscall, so with more than one
+ * node they are kept on the processor's own. Otherwise they come from the
+ * heap like any other allocation.
+ *
+ * @param uint32_t node - The node of the processor.
+ * @return the base of the stack, 0 on failure.
+ * */
+static uintptr_t smp_alloc_stack(uint32_t node) {
+	if (numa_node_count() > 1) {
+		return (uintptr_t)numa_alloc(ARC_STD_KSTACK_SIZE, node);
+	}
+
+	return (uintptr_t)alloc(ARC_STD_KSTACK_SIZE);
 }
 
 static int smp_register_ap(uint32_t acpi_uid, uint32_t acpi_flags) {
@@ -93,6 +145,14 @@ static int smp_register_ap(uint32_t acpi_uid, uint32_t acpi_flags) {
 		Arc_BootProcessor = current;
 	} else {
 		current = &Arc_ProcessorList[Arc_ProcessorCounter];
+		// NOTE: The list comes from alloc(), the per-processor state of
+		//       the pager and TLB code expects to start out zeroed, like
+		//       the BSP's static descriptor
+		memset(current, 0, sizeof(*current));
+		// NOTE: Point GSBase at the zeroed descriptor right away, the
+		//       allocations below may reach the pager, which checks
+		//       it to tell whether this processor is registered
+		context_set_proc_desc(current);
 	}
 
 	ARC_ProcessorDescriptor *desc = &current->descriptor;
@@ -102,8 +162,9 @@ static int smp_register_ap(uint32_t acpi_uid, uint32_t acpi_flags) {
 	desc->acpi_uid = acpi_uid;
 	desc->acpi_flags = acpi_flags;
 
-	uintptr_t ist1 = (uintptr_t)alloc(ARC_STD_KSTACK_SIZE);
-	uintptr_t rsp0 = (uintptr_t)alloc(ARC_STD_KSTACK_SIZE);
+	uint32_t node = numa_current_node();
+	uintptr_t ist1 = smp_alloc_stack(node);
+	uintptr_t rsp0 = smp_alloc_stack(node);
 
 	ARC_TSSDescriptor *tss = &current->proc_structs.tss;
 	ARC_GDTRegister *gdtr = &current->proc_structs.gdtr;
@@ -123,9 +184,16 @@ static int smp_register_ap(uint32_t acpi_uid, uint32_t acpi_flags) {
 
 	context_set_proc_desc(current);
 	context_set_proc_features(&current->features);
+	current->numa_node = node;
 
 	init_lapic();
 
+	if (init_tlb() != 0) {
+		// NOTE: Booting on keeps the BSP from waiting on the processor
+		//       forever, it is parked in smp_hold without doing any work
+		ARC_DEBUG(WARN, "Failed to register processor for TLB shootdowns, parking it\n");
+	}
+
 	ARC_IDTRegister *idtr = &current->proc_structs.idtr;
 	ARC_IDTEntry *entries = current->proc_structs.idt_entries;
 	const size_t entry_count = sizeof(current->proc_structs.idt_entries) / sizeof(ARC_IDTEntry);
@@ -140,7 +208,7 @@ static int smp_register_ap(uint32_t acpi_uid, uint32_t acpi_flags) {
 
 	current->ist1 = ist1;
 	current->rsp0 = rsp0;
-	current->syscall_stack = (uintptr_t)alloc(ARC_STD_KSTACK_SIZE);
+	current->syscall_stack = smp_alloc_stack(node);
 
 	if (current->syscall_stack == 0) {
 		ARC_DEBUG(ERR, "Failed to allocate syscall stack\n");
@@ -158,14 +226,27 @@ static int smp_register_ap(uint32_t acpi_uid, uint32_t acpi_flags) {
 		desc->timer_mode = ARC_LAPIC_TIMER_PERIODIC;
 		lapic_refresh_timer(1000);
 		lapic_calibrate_timer();
+	} else {
+		// Wake from smp_hold now and then to do idle work
+		lapic_setup_timer(ARC_SMP_IDLE_VECTOR, ARC_LAPIC_TIMER_PERIODIC);
+		lapic_refresh_timer(ARC_SMP_IDLE_TIMER_COUNT);
 	}
 
 	interrupt_set(idtr, 32, ARC_NAME_IRQ(sched_timer_hook), true);
+	interrupt_set(idtr, ARC_TLB_SHOOTDOWN_VECTOR, ARC_NAME_IRQ(tlb_shootdown_handler), true);
+	interrupt_set(idtr, ARC_SMP_IDLE_VECTOR, ARC_NAME_IRQ(smp_idle_tick), true);
 
 	init_pcid();
 
 	Arc_ProcessorCounter++;
 
+	if (current == Arc_BootProcessor) {
+		// NOTE: The BSP goes on to run the kernel with interrupts
+		//       enabled, and services its mailbox while it waits on the
+		//       APs during their start
+		tlb_set_interruptible();
+	}
+
 	ARC_DEBUG(INFO, "Registered processor (acpi_uid=%d)\n", acpi_uid);
 
 	desc->flags |= 1 << ARC_SMP_FLAGS_INIT;
@@ -223,17 +304,22 @@ void smp_switch_to(ARC_Context *ctx) {
 //       ator
 // TODO: This will be useful for KPTI.
 int smp_map_processor_structures(void *page_tables) {
+	if (pager_shares_kernel_half(page_tables)) {
+		// Everything below is in the kernel's half, and already there
+		return 0;
+	}
+
 	pager_map(page_tables, (uintptr_t)Arc_ProcessorList, ARC_HHDM_TO_PHYS(Arc_ProcessorList), sizeof(*Arc_ProcessorList) * Arc_ProcessorCounter, 1 << ARC_PAGER_RW | 1 << ARC_PAGER_NX);
 
 	const uint32_t flags = 1 << ARC_PAGER_RW | 1 << ARC_PAGER_NX;
 
 	for (uint32_t i = 0; i < Arc_ProcessorCounter; i++) {
-		ARC_x64ProcessorDescriptor desc = Arc_ProcessorList[i];
-		pager_map(page_tables, (uintptr_t)desc.ist1, ARC_HHDM_TO_PHYS(desc.ist1), ARC_STD_KSTACK_SIZE, flags);
-		pager_map(page_tables, (uintptr_t)desc.rsp0, ARC_HHDM_TO_PHYS(desc.rsp0), ARC_STD_KSTACK_SIZE, flags);
-		pager_map(page_tables, (uintptr_t)desc.syscall_stack, ARC_HHDM_TO_PHYS(desc.syscall_stack), ARC_STD_KSTACK_SIZE, flags);
+		ARC_x64ProcessorDescriptor *desc = &Arc_ProcessorList[i];
+		pager_map(page_tables, (uintptr_t)desc->ist1, ARC_HHDM_TO_PHYS(desc->ist1), ARC_STD_KSTACK_SIZE, flags);
+		pager_map(page_tables, (uintptr_t)desc->rsp0, ARC_HHDM_TO_PHYS(desc->rsp0), ARC_STD_KSTACK_SIZE, flags);
+		pager_map(page_tables, (uintptr_t)desc->syscall_stack, ARC_HHDM_TO_PHYS(desc->syscall_stack), ARC_STD_KSTACK_SIZE, flags);
 
-		pager_map(page_tables, (uintptr_t)&desc, ARC_HHDM_TO_PHYS(&desc), sizeof(desc), flags);
+		pager_map(page_tables, (uintptr_t)desc, ARC_HHDM_TO_PHYS(desc), sizeof(*desc), flags);
 
 		ARC_DEBUG(INFO, "Cloned mappings for processor-specific structures to table %p for processor %d\n", page_tables, i);
 	}
@@ -304,7 +390,11 @@ int smp_init_ap(uint32_t processor, uint32_t acpi_uid, uint32_t acpi_flags, uint
 	ARC_DEBUG(INFO, "AP %d BIST: 0x%x\n", processor, info->eax);
 
 	// TODO: If BIST indicates error, shut down AP, move on
-	while (((info->flags >> ARC_AP_INFO_FLAGS_LM) & 1) == 0) __asm__("pause");
+	while (((info->flags >> ARC_AP_INFO_FLAGS_LM) & 1) == 0) {
+		// The AP or the others may be shooting this processor down
+		tlb_shootdown_service();
+		__asm__("pause");
+	}
 
 	pager_unmap(NULL, ARC_HHDM_TO_PHYS(code), PAGE_SIZE, NULL);
 	pager_unmap(NULL, ARC_HHDM_TO_PHYS(stack), PAGE_SIZE, NULL);
@@ -29,6 +29,7 @@
 #include "arch/x86-64/apic.h"
 #include "arch/x86-64/ctrl_regs.h"
 #include "arch/x86-64/interrupt.h"
+#include "arch/x86-64/numa.h"
 #include "arch/x86-64/smp.h"
 #include "global.h"
 #include "util.h"
@@ -60,6 +61,13 @@ int init_arch_early() {
 }
 
 int init_arch() {
+        // NOTE: Tables are looked up by the kernel's ACPI code, which has to
+        //       hand the SRAT and SLIT to numa_parse_srat and numa_parse_slit
+        //       before this point for the APs to get node local structures
+        if (numa_node_count() == 0) {
+                ARC_DEBUG(INFO, "No SRAT parsed, allocating without regard to NUMA nodes\n");
+        }
+
         if (init_apic() != 0) {
                 ARC_DEBUG(ERR, "Failed to initialize interrupts\n");
                 ARC_HANG;
@@ -0,0 +1,579 @@
+/**
+ * @file tlb.c
+ *
+ * @author awewsomegamer <awewsomegamer@gmail.com>
+ *
+ * @LICENSE
+ * Arctan-OS/Karch-x86-64 - x86-64 Implementation of K/arch Abstractions
+ * Copyright (C) 2023-2025 awewsomegamer
+ *
+ * This file is part of Arctan-OS/Karch-x86-64.
+ *
+ * Arctan-OS/Karch-x86-64 is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * @DESCRIPTION
+ * Batched invalidation of TLB entries, and the shootdown protocol used to
+ * invalidate entries on other processors.
+*/
+#include "arch/info.h"
+#include "arch/interrupt.h"
+#include "arch/pager.h"
+#include "arch/x86-64/apic/local.h"
+#include "arch/x86-64/config.h"
+#include "arch/x86-64/context.h"
+#include "arch/x86-64/ctrl_regs.h"
+#include "arch/x86-64/interrupt.h"
+#include "arch/x86-64/pager.h"
+#include "arch/x86-64/smp.h"
+#include "arch/x86-64/tlb.h"
+#include "arch/x86-64/util.h"
+#include "global.h"
+#include "lib/spinlock.h"
+#include "util.h"
+
+#include <cpuid.h>
+
+// Bit n of tlb_cpu_masks[pcid] is set if processor n may hold entries of
+// the address space pcid
+static uint64_t USERSPACE(bss) tlb_cpu_masks[ARC_TLB_ADDRESS_SPACES];
+static ARC_x64ProcessorDescriptor *tlb_processors[ARC_TLB_MAX_PROCESSORS];
+static ARC_TLBMailbox tlb_mailboxes[ARC_TLB_MAX_PROCESSORS];
+// Processors in tlb_processors and tlb_mailboxes that are set up and may be
+// shot down, indices below tlb_processor_reserved are being set up
+static uint32_t USERSPACE(bss) tlb_processor_count = 0;
+static uint32_t tlb_processor_reserved = 0;
+// Bit n is set once processor n takes shootdown IPIs, see
+// tlb_set_interruptible
+static uint64_t tlb_interruptible = 0;
+// Whether entries into the kernel stay on the loaded page tables when those
+// share the kernel's half, see tlb_set_shared_entry
+static bool USERSPACE(bss) tlb_shared_entry = false;
+
+static uint64_t tlb_latency_cycles[ARC_TLB_MAX_PROCESSORS];
+static uint64_t tlb_latency_samples[ARC_TLB_MAX_PROCESSORS];
+
+void tlb_batch_init(ARC_TLBBatch *batch, uint32_t pcid, bool local) {
+        batch->range_count = 0;
+        batch->pages = 0;
+        batch->pcid = pcid;
+        batch->local = local;
+        batch->full = false;
+}
+
+void tlb_batch_add(ARC_TLBBatch *batch, uintptr_t virtual, uint32_t shift) {
+        if (batch->full) {
+                return;
+        }
+
+        if (++batch->pages > ARC_TLB_FLUSH_THRESHOLD) {
+                batch->full = true;
+                return;
+        }
+
+        if (batch->range_count > 0) {
+                ARC_TLBRange *last = &batch->ranges[batch->range_count - 1];
+
+                if (last->shift == shift && last->base + ((uintptr_t)last->count << shift) == virtual) {
+                        last->count++;
+                        return;
+                }
+        }
+
+        if (batch->range_count >= ARC_TLB_BATCH_RANGES) {
+                batch->full = true;
+                return;
+        }
+
+        ARC_TLBRange *range = &batch->ranges[batch->range_count++];
+        range->base = virtual;
+        range->count = 1;
+        range->shift = shift;
+}
+
+/**
+ * Mark the entries the current processor holds for the address space as
+ * stale.
+ *
+ * The next load of the address space will flush them. If the address space
+ * is not loaded, the processor also stops receiving shootdowns for it.
+ *
+ * @param uint32_t pcid - The address space.
+ * */
+static void tlb_forget(uint32_t pcid) {
+        bool I = arch_interrupts_enabled();
+        ARC_DISABLE_INTERRUPT;
+
+        Arc_CurProcessorDescriptor->tlb.valid[pcid / 64] &= ~(1ULL << (pcid % 64));
+
+        if (pcid != ARC_TLB_ADDRESS_SPACE(_x86_getCR3())) {
+                __atomic_and_fetch(&tlb_cpu_masks[pcid], ~(1ULL << Arc_CurProcessorDescriptor->tlb.index), __ATOMIC_ACQ_REL);
+        }
+
+        if (I) {
+                ARC_ENABLE_INTERRUPT;
+        }
+}
+
+/**
+ * Mark the entries the current processor holds for every address space,
+ * other than the current one, as stale.
+ * */
+static void tlb_forget_others() {
+        bool I = arch_interrupts_enabled();
+        ARC_DISABLE_INTERRUPT;
+
+        uint32_t current = ARC_TLB_ADDRESS_SPACE(_x86_getCR3());
+
+        for (int i = 0; i < ARC_TLB_ADDRESS_SPACES / 64; i++) {
+                Arc_CurProcessorDescriptor->tlb.valid[i] = 0;
+        }
+
+        Arc_CurProcessorDescriptor->tlb.valid[current / 64] |= 1ULL << (current % 64);
+
+        if (I) {
+                ARC_ENABLE_INTERRUPT;
+        }
+}
+
+static void tlb_invalidate_range(ARC_TLBRange *range) {
+        ARC_PAGER_COUNT(invlpg, range->count);
+
+        for (uint32_t i = 0; i < range->count; i++) {
+                tlb_invalidate_page(range->base + ((uintptr_t)i << range->shift));
+        }
+}
+
+/**
+ * Invalidate a range in an address space that may not be loaded.
+ *
+ * Unlike tlb_forget, the address space stays valid, so it is not flushed as
+ * a whole when CR3 is next loaded with it.
+ *
+ * @param uint32_t pcid - The address space.
+ * @param ARC_TLBRange *range - The range, every page of the address space if
+ * its count is zero.
+ * @return zero on success, -1 if INVPCID cannot be used.
+ * */
+static int tlb_invalidate_pcid_range(uint32_t pcid, ARC_TLBRange *range) {
+        if (!Arc_CurProcessorDescriptor->tlb.invpcid) {
+                return -1;
+        }
+
+        struct {
+                uint64_t pcid;
+                uint64_t address;
+        } __attribute__((aligned(16))) descriptor = { .pcid = pcid, .address = 0 };
+
+        if (range->count == 0) {
+                // Single context, every non-global entry of the PCID
+                __asm__ volatile("invpcid %0, [%1]" :: "r"(1ULL), "r"(&descriptor) : "memory");
+                ARC_PAGER_COUNT(flushes, 1);
+                return 0;
+        }
+
+        ARC_PAGER_COUNT(invlpg, range->count);
+
+        for (uint32_t i = 0; i < range->count; i++) {
+                // Individual address
+                descriptor.address = range->base + ((uintptr_t)i << range->shift);
+                __asm__ volatile("invpcid %0, [%1]" :: "r"(0ULL), "r"(&descriptor) : "memory");
+        }
+
+        return 0;
+}
+
+/**
+ * Post the batch to the mailbox of the given processor.
+ *
+ * @param uint32_t target - The index of the processor to post to.
+ * @param ARC_TLBBatch *batch - The batch to post.
+ * @return the request number to wait on.
+ * */
+static uint64_t tlb_post(uint32_t target, ARC_TLBBatch *batch) {
+        ARC_TLBMailbox *mailbox = &tlb_mailboxes[target];
+
+        spinlock_lock(&mailbox->lock);
+
+        if (batch->full && mailbox->count < ARC_TLB_MAILBOX_SIZE) {
+                ARC_TLBMailboxEntry *entry = &mailbox->entries[mailbox->count++];
+                entry->pcid = batch->pcid;
+                entry->range.count = 0;
+        } else if (batch->full || mailbox->count + batch->range_count > ARC_TLB_MAILBOX_SIZE) {
+                mailbox->full = true;
+        } else {
+                for (uint32_t i = 0; i < batch->range_count; i++) {
+                        ARC_TLBMailboxEntry *entry = &mailbox->entries[mailbox->count++];
+                        entry->pcid = batch->pcid;
+                        entry->range = batch->ranges[i];
+                }
+        }
+
+        uint64_t request = ++mailbox->requested;
+
+        spinlock_unlock(&mailbox->lock);
+
+        return request;
+}
+
+static void tlb_shootdown(ARC_TLBBatch *batch) {
+        bool registered = smp_registered();
+        uint64_t self = registered ? 1ULL << Arc_CurProcessorDescriptor->tlb.index : 0;
+
+        // Order the writes to the page tables before reading the mask, a
+        // processor that sets its bit after this point will walk the new
+        // tables when it loads them
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        uint64_t targets = 0;
+
+        if (batch->pcid == ARC_TLB_ALL_ADDRESS_SPACES) {
+                uint32_t count = __atomic_load_n(&tlb_processor_count, __ATOMIC_ACQUIRE);
+                targets = count >= 64 ? ~0ULL : (1ULL << count) - 1;
+        } else {
+                targets = __atomic_load_n(&tlb_cpu_masks[batch->pcid], __ATOMIC_ACQUIRE);
+        }
+
+        // NOTE: A processor that cannot take the IPI yet would never answer
+        //       it, it flushes everything once it can instead
+        targets &= ~self & __atomic_load_n(&tlb_interruptible, __ATOMIC_ACQUIRE);
+
+        if (targets == 0) {
+                return;
+        }
+
+        uint64_t requests[ARC_TLB_MAX_PROCESSORS];
+        uint32_t count = 0;
+        uint64_t start = arch_get_cycles();
+
+        for (uint64_t pending = targets; pending != 0; pending &= pending - 1) {
+                int i = __builtin_ctzll(pending);
+
+                requests[i] = tlb_post(i, batch);
+                lapic_ipi(ARC_TLB_SHOOTDOWN_VECTOR, tlb_processors[i]->tlb.lapic, ARC_LAPIC_IPI_FIXED | ARC_LAPIC_IPI_PHYSICAL | ARC_LAPIC_IPI_ASSERT);
+                while (lapic_ipi_poll()) __asm__("pause");
+
+                count++;
+        }
+
+        ARC_PAGER_COUNT(shootdowns, count);
+
+        for (uint64_t pending = targets; pending != 0; pending &= pending - 1) {
+                int i = __builtin_ctzll(pending);
+                ARC_TLBMailbox *mailbox = &tlb_mailboxes[i];
+
+                while (__atomic_load_n(&mailbox->completed, __ATOMIC_ACQUIRE) < requests[i]) {
+                        // Two processors may be shooting each other down
+                        // with interrupts disabled, so service our own
+                        // mailbox while waiting
+                        if (registered) {
+                                tlb_shootdown_service();
+                        }
+                        __asm__("pause");
+                }
+        }
+
+        __atomic_add_fetch(&tlb_latency_cycles[count - 1], arch_get_cycles() - start, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&tlb_latency_samples[count - 1], 1, __ATOMIC_RELAXED);
+}
+
+void tlb_batch_flush(ARC_TLBBatch *batch) {
+        if (batch->pages == 0) {
+                return;
+        }
+
+        if (batch->local) {
+                if (batch->full && batch->pcid == ARC_TLB_ALL_ADDRESS_SPACES) {
+                        tlb_flush_global();
+                } else if (batch->full) {
+                        tlb_flush_all();
+                } else {
+                        for (uint32_t i = 0; i < batch->range_count; i++) {
+                                tlb_invalidate_range(&batch->ranges[i]);
+                        }
+                }
+        } else if (smp_registered() && ARC_TLB_ADDRESS_SPACE(_x86_getCR3()) != batch->pcid) {
+                // With PCIDs this processor may still hold entries of an
+                // address space it is not running
+                tlb_forget(batch->pcid);
+        }
+
+        if (batch->pcid == ARC_TLB_ALL_ADDRESS_SPACES && smp_registered()) {
+                tlb_forget_others();
+        }
+
+        if (tlb_processor_count > 1) {
+                tlb_shootdown(batch);
+        }
+
+        tlb_batch_init(batch, batch->pcid, batch->local);
+}
+
+void tlb_flush_all() {
+        // NOTE: Bit 63 of CR3 always reads as zero, so writing the value
+        //       back flushes every non-global entry. With PCIDs enabled only
+        //       the entries tagged with the current PCID are flushed.
+        _x86_setCR3(_x86_getCR3());
+        ARC_PAGER_COUNT(flushes, 1);
+}
+
+void tlb_flush_global() {
+        uint64_t cr4 = _x86_getCR4();
+
+        if (((cr4 >> 7) & 1) == 0) {
+                tlb_flush_all();
+                return;
+        }
+
+        // Toggling PGE flushes every entry, global or not, of every PCID
+        _x86_setCR4(cr4 & ~(1 << 7));
+        _x86_setCR4(cr4);
+        ARC_PAGER_COUNT(flushes, 1);
+}
+
+uint64_t USERSPACE(text) tlb_prepare_cr3(uint64_t cr3) {
+        if (!smp_registered()) {
+                // No processor descriptor to keep track in yet
+                return cr3;
+        }
+
+        Arc_CurProcessorDescriptor->counters.cr3_loads++;
+
+        uint32_t pcid = ARC_TLB_ADDRESS_SPACE(cr3);
+        uint64_t bit = 1ULL << Arc_CurProcessorDescriptor->tlb.index;
+        uint64_t *mask = &tlb_cpu_masks[pcid];
+
+        if ((__atomic_load_n(mask, __ATOMIC_RELAXED) & bit) == 0) {
+                __atomic_or_fetch(mask, bit, __ATOMIC_ACQ_REL);
+        }
+
+        if (!MASKED_READ(Arc_CurProcessorDescriptor->features.paging, ARC_PAGER_FLAG_PCID, 1)) {
+                return cr3;
+        }
+
+        uint64_t valid = Arc_CurProcessorDescriptor->tlb.valid[pcid / 64];
+
+        if ((valid >> (pcid % 64)) & 1) {
+                return cr3 | (1ULL << 63);
+        }
+
+        // The load will flush whatever is stale, the entries are up to date
+        // from then on
+        Arc_CurProcessorDescriptor->tlb.valid[pcid / 64] = valid | (1ULL << (pcid % 64));
+
+        return cr3;
+}
+
+uint64_t USERSPACE(text) tlb_enter(uint64_t cr3) {
+        bool registered = smp_registered();
+
+        if (registered && Arc_CurProcessorDescriptor->tlb.shared) {
+                // Everything the kernel needs is already mapped
+                return 0;
+        }
+
+        // Whatever the kernel enters on has its half
+        if (registered) {
+                Arc_CurProcessorDescriptor->tlb.shared = __atomic_load_n(&tlb_shared_entry, __ATOMIC_RELAXED);
+        }
+
+        return tlb_prepare_cr3(cr3);
+}
+
+uint64_t tlb_leave(uint64_t cr3) {
+        if (!smp_registered()) {
+                return tlb_prepare_cr3(cr3);
+        }
+
+        // NOTE: This runs on the tables the kernel entered on, so the rest
+        //       of the kernel can be reached
+        bool shared = __atomic_load_n(&tlb_shared_entry, __ATOMIC_RELAXED)
+                      && pager_shares_kernel_half((void *)ARC_PHYS_TO_HHDM(cr3 & ~(1ULL << 63)));
+
+        Arc_CurProcessorDescriptor->tlb.shared = shared;
+
+        if ((cr3 & ~(1ULL << 63)) == _x86_getCR3()) {
+                // Never switched away from the tables, and the entries of
+                // the loaded address space are never left stale
+                return 0;
+        }
+
+        return tlb_prepare_cr3(cr3);
+}
+
+void tlb_set_shared_entry(bool enable) {
+        __atomic_store_n(&tlb_shared_entry, enable, __ATOMIC_RELEASE);
+}
+
+void tlb_set_interruptible() {
+        if (!smp_registered()) {
+                return;
+        }
+
+        bool I = arch_interrupts_enabled();
+        ARC_DISABLE_INTERRUPT;
+
+        __atomic_or_fetch(&tlb_interruptible, 1ULL << Arc_CurProcessorDescriptor->tlb.index, __ATOMIC_SEQ_CST);
+
+        // Shootdowns up to this point passed the processor by, and any
+        // after it target the processor
+        tlb_forget_others();
+        tlb_flush_global();
+
+        if (I) {
+                ARC_ENABLE_INTERRUPT;
+        }
+}
+
+void tlb_invalidate_address_space(uint32_t pcid) {
+        ARC_TLBBatch batch;
+
+        tlb_batch_init(&batch, pcid, false);
+        batch.pages = ARC_TLB_FLUSH_THRESHOLD + 1;
+        batch.full = true;
+
+        tlb_batch_flush(&batch);
+}
+
+void tlb_shootdown_service() {
+        if (!smp_registered()) {
+                return;
+        }
+
+        // NOTE: Called from tlb_shootdown with interrupts possibly enabled,
+        //       the IPI must not come in while the mailbox is locked
+        bool I = arch_interrupts_enabled();
+        ARC_DISABLE_INTERRUPT;
+
+        ARC_TLBMailbox *mailbox = &tlb_mailboxes[Arc_CurProcessorDescriptor->tlb.index];
+
+        if (__atomic_load_n(&mailbox->requested, __ATOMIC_ACQUIRE) == __atomic_load_n(&mailbox->completed, __ATOMIC_RELAXED)) {
+                goto done;
+        }
+
+        ARC_TLBMailboxEntry entries[ARC_TLB_MAILBOX_SIZE];
+
+        spinlock_lock(&mailbox->lock);
+
+        uint32_t count = mailbox->count;
+        bool full = mailbox->full;
+        uint64_t request = mailbox->requested;
+
+        memcpy(entries, mailbox->entries, sizeof(*entries) * count);
+        mailbox->count = 0;
+        mailbox->full = false;
+
+        spinlock_unlock(&mailbox->lock);
+
+        // NOTE: The handler runs on the kernel's tables, so the address
+        //       space that was interrupted is usually not the one loaded.
+        //       Other address spaces are invalidated with INVPCID where
+        //       possible, otherwise they are marked stale, so that they are
+        //       flushed when CR3 is next loaded with them (when returning
+        //       from this interrupt for instance).
+        uint32_t current = ARC_TLB_ADDRESS_SPACE(_x86_getCR3());
+
+        if (full) {
+                tlb_forget_others();
+                tlb_flush_global();
+        } else {
+                for (uint32_t i = 0; i < count; i++) {
+                        if (entries[i].pcid == ARC_TLB_ALL_ADDRESS_SPACES) {
+                                tlb_forget_others();
+                        }
+
+                        if (entries[i].pcid != current && entries[i].pcid != ARC_TLB_ALL_ADDRESS_SPACES) {
+                                if (tlb_invalidate_pcid_range(entries[i].pcid, &entries[i].range) != 0) {
+                                        tlb_forget(entries[i].pcid);
+                                }
+                        } else if (entries[i].range.count == 0 && entries[i].pcid == ARC_TLB_ALL_ADDRESS_SPACES) {
+                                // Shared tables are the only ones with
+                                // global pages
+                                tlb_flush_global();
+                        } else if (entries[i].range.count == 0) {
+                                tlb_flush_all();
+                        } else {
+                                tlb_invalidate_range(&entries[i].range);
+                        }
+                }
+        }
+
+        __atomic_store_n(&mailbox->completed, request, __ATOMIC_RELEASE);
+
+        done:;
+
+        if (I) {
+                ARC_ENABLE_INTERRUPT;
+        }
+}
+
+static void tlb_shootdown_handler(ARC_InterruptFrame *frame) {
+        (void)frame;
+
+        tlb_shootdown_service();
+        lapic_eoi();
+}
+ARC_DEFINE_IRQ_HANDLER(tlb_shootdown_handler, Arc_KernelPageTables);
+
+void tlb_shootdown_report() {
+        for (uint32_t i = 0; i < ARC_TLB_MAX_PROCESSORS; i++) {
+                uint64_t samples = __atomic_load_n(&tlb_latency_samples[i], __ATOMIC_RELAXED);
+
+                if (samples == 0) {
+                        continue;
+                }
+
+                uint64_t cycles = __atomic_load_n(&tlb_latency_cycles[i], __ATOMIC_RELAXED);
+
+                ARC_DEBUG(INFO, "Shootdown to %d processor(s): %"PRIu64" cycles on average (%"PRIu64" samples)\n", i + 1, cycles / samples, samples);
+        }
+}
+
+int init_tlb() {
+        uint32_t index = __atomic_fetch_add(&tlb_processor_reserved, 1, __ATOMIC_ACQ_REL);
+
+        if (index >= ARC_TLB_MAX_PROCESSORS) {
+                ARC_DEBUG(ERR, "Too many processors for TLB shootdowns\n");
+                return -1;
+        }
+
+        ARC_x64ProcessorDescriptor *desc = context_get_proc_desc();
+
+        desc->tlb.index = index;
+        desc->tlb.lapic = lapic_get_id();
+
+        uint32_t eax, ebx, ecx, edx;
+        __cpuid(0, eax, ebx, ecx, edx);
+
+        if (eax >= 7 && MASKED_READ(desc->features.paging, ARC_PAGER_FLAG_PCID, 1)) {
+                __cpuid_count(7, 0, eax, ebx, ecx, edx);
+                desc->tlb.invpcid = MASKED_READ(ebx, 10, 1);
+        }
+
+        memset(&tlb_mailboxes[index], 0, sizeof(*tlb_mailboxes));
+        init_static_spinlock(&tlb_mailboxes[index].lock);
+
+        tlb_processors[index] = desc;
+
+        // Publish in the order of the indices, a shooter that sees the count
+        // must see every slot below it filled in
+        while (__atomic_load_n(&tlb_processor_count, __ATOMIC_ACQUIRE) != index) {
+                __asm__("pause");
+        }
+
+        __atomic_store_n(&tlb_processor_count, index + 1, __ATOMIC_RELEASE);
+        desc->tlb.registered = true;
+
+        ARC_DEBUG(INFO, "Registered processor %d for TLB shootdowns\n", index);
+
+        return 0;
+}